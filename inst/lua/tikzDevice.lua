@@ -0,0 +1,107 @@
+-- Drawing routines for the LuaTeX drawing mode of the tikzDevice.
+--
+-- In this mode the device writes the coordinates of large shapes as Lua
+-- tables inside \directlua. The functions below turn them into PDF path
+-- operators that are added to the page as literals, just like the ones PGF
+-- writes for its own paths. TeX then only has to read the digits instead of
+-- expanding a handful of macros for every coordinate.
+--
+-- The coordinates of a shape arrive in several calls to `tikzdev.data` so
+-- that no single call grows too large for TeX. A call to `tikzdev.path` or
+-- `tikzdev.circles` then paints them.
+--
+-- The device copies this file into its output with comment lines and blank
+-- lines removed, so every statement must be complete without them. The
+-- catcodes of %, #, ~ and " are set to "other" while it is read. The code must
+-- not contain backslashes and its braces must balance.
+
+if tikzdev == nil then
+
+  tikzdev = {}
+
+  -- Coordinates arrive in TeX points, PDF works in big points.
+  local scale = 72 / 72.27
+
+  -- Control point distance of the Bezier curves that approximate a quarter
+  -- circle. PGF uses the same value.
+  local kappa = 0.5522847498
+
+  local format = string.format
+  local concat = table.concat
+
+  -- Painting operators indexed by the drawing operations of the device: 1 to
+  -- stroke, 2 to fill and 3 to do both. Adding 4 selects the even-odd rule.
+  local operators = { "S", "f", "B", "n", "S", "f*", "B*" }
+  operators[0] = "n"
+
+  -- Values collected for the shape that is being written.
+  local pending, count = {}, 0
+
+  local function point(x, y)
+    return format("%.3f %.3f", x * scale, y * scale)
+  end
+
+  -- Adds PDF code to the current list in the same way as \pdfliteral, which
+  -- is what PGF uses.
+  local function literal(data)
+    local whatsit = node.new("whatsit", "pdf_literal")
+    whatsit.mode = 0
+    whatsit.data = data
+    node.write(whatsit)
+  end
+
+  function tikzdev.data(values)
+    for i = 1, #values do
+      pending[count + i] = values[i]
+    end
+    count = count + #values
+  end
+
+  -- Paints subpaths, each given by its number of vertices followed by the x
+  -- and y coordinates of each vertex. If `closed` is true every subpath is
+  -- closed.
+  function tikzdev.path(ops, closed)
+    local out, n, i = {}, 0, 1
+    while i <= count do
+      local vertices = pending[i]
+      i = i + 1
+      for j = 1, vertices do
+        n = n + 1
+        out[n] = point(pending[i], pending[i + 1]) .. (j == 1 and " m" or " l")
+        i = i + 2
+      end
+      if closed then
+        n = n + 1
+        out[n] = "h"
+      end
+    end
+    n = n + 1
+    out[n] = operators[ops]
+    pending, count = {}, 0
+    literal(concat(out, " "))
+  end
+
+  -- Paints circles, each given by the x and y coordinates of its center and
+  -- its radius.
+  function tikzdev.circles(ops)
+    local out, n = {}, 0
+    for i = 1, count - 2, 3 do
+      local x, y, r = pending[i], pending[i + 1], pending[i + 2]
+      local k = kappa * r
+      n = n + 1
+      out[n] = concat({
+        point(x + r, y), "m",
+        point(x + r, y + k), point(x + k, y + r), point(x, y + r), "c",
+        point(x - k, y + r), point(x - r, y + k), point(x - r, y), "c",
+        point(x - r, y - k), point(x - k, y - r), point(x, y - r), "c",
+        point(x + k, y - r), point(x + r, y - k), point(x + r, y), "c",
+        "h"
+      }, " ")
+    end
+    n = n + 1
+    out[n] = operators[ops]
+    pending, count = {}, 0
+    literal(concat(out, " "))
+  end
+
+end
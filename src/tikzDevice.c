@@ -82,6 +82,7 @@ SEXP TikZ_StartDevice ( SEXP args ){
   const char *documentDeclaration, *packages, *footer;
   double baseSize;
   Rboolean console, sanitize, onefile;
+  TikZ_Options options;
 
   /* 
    * pGEDevDesc is a variable provided by the R Graphics Engine
@@ -159,7 +160,146 @@ SEXP TikZ_StartDevice ( SEXP args ){
   /*
    * See the definition of tikz_engine in tikzDevice.h
    */
-  int engine = asInteger(CAR(args));
+  int engine = asInteger(CAR(args)); args = CDR(args);
+
+  /*
+   * Number of bytes of output that will be collected in memory before being
+   * written to the file or console. A value of 0 causes every fragment of
+   * output to be written immediately.
+   */
+  options.outputBufferSize = asInteger(CAR(args)); args = CDR(args);
+
+  /*
+   * Number of digits written after the decimal point of coordinates and
+   * whether trailing zeros in those digits should be dropped.
+   */
+  options.coordPrecision = asInteger(CAR(args)); args = CDR(args);
+  options.trimZeros = asLogical(CAR(args)); args = CDR(args);
+
+  /*
+   * Should the vertices of long paths be written as offsets from the previous
+   * vertex?
+   */
+  options.relativeCoords = asLogical(CAR(args)); args = CDR(args);
+
+  /*
+   * Should sets of path options that are used repeatedly be given names using
+   * \tikzset?
+   */
+  options.styleDictionary = asLogical(CAR(args)); args = CDR(args);
+
+  /*
+   * Maximum distance, in points, that the vertices of lines and polygons may
+   * be moved by simplification. A value of 0 disables simplification.
+   */
+  options.simplifyTolerance = asReal(CAR(args)); args = CDR(args);
+
+  /*
+   * Should vertices that round to the same position as their neighbour, or
+   * that lie on a straight line between their neighbours, be dropped?
+   */
+  options.dropRedundant = asLogical(CAR(args)); args = CDR(args);
+
+  /*
+   * Should consecutive shapes drawn with the same options be collected into a
+   * single path?
+   */
+  options.batchPrimitives = asLogical(CAR(args)); args = CDR(args);
+
+  /*
+   * Should small polygons and lines that are repeated at different positions,
+   * like plot symbols, be defined once and reused?
+   */
+  options.plotMarks = asLogical(CAR(args)); args = CDR(args);
+
+  /*
+   * An environment in which the output will be stored as a raw vector named
+   * `output` when the device is closed, or NULL if the output should go to a
+   * file or the console as usual.
+   */
+  options.memory = CAR(args); args = CDR(args);
+
+  /*
+   * Should output to files be written by a background thread?
+   */
+  options.asyncWrite = asLogical(CAR(args)); args = CDR(args);
+
+  /*
+   * Should shapes outside of the clipping region be skipped and lines and
+   * polygons be cut down to the part that can be seen?
+   */
+  options.clipPrimitives = asLogical(CAR(args)); args = CDR(args);
+
+  /*
+   * Should opaque shapes that are completely covered by later opaque shapes
+   * on the same page be left out?
+   */
+  options.occlusionCulling = asLogical(CAR(args)); args = CDR(args);
+
+  /*
+   * Should every color get a name of its own instead of redefining drawColor
+   * and fillColor whenever the color changes?
+   */
+  options.colorPalette = asLogical(CAR(args)); args = CDR(args);
+
+  /*
+   * How many primitives may be drawn inside one clipping region before the
+   * rest are painted onto an image instead, and the resolution of that image
+   * in pixels per inch. A budget of zero turns this off.
+   */
+  options.rasterBudget = asInteger(CAR(args)); args = CDR(args);
+  options.rasterResolution = asReal(CAR(args)); args = CDR(args);
+
+  /*
+   * Width, in points, of the columns used to thin out lines whose x values
+   * only ever increase or decrease. A value of 0 disables this.
+   */
+  options.decimationWidth = asReal(CAR(args)); args = CDR(args);
+
+  /*
+   * Should grids of filled rectangles, as drawn by image() and heatmaps, be
+   * written as a raster?
+   */
+  options.rasterizeTiles = asLogical(CAR(args)); args = CDR(args);
+
+  /*
+   * Should shapes be written as commands of the PGF basic layer instead of
+   * TikZ paths?
+   */
+  options.pgfBasicLayer = asLogical(CAR(args)); args = CDR(args);
+
+  /*
+   * Lines and paths with at least this many vertices have their coordinates
+   * written to a data file of their own. A value of 0 disables this.
+   */
+  options.dataThreshold = asInteger(CAR(args)); args = CDR(args);
+
+  /*
+   * Should large shapes be painted by Lua code when typesetting with LuaTeX?
+   * The code itself is read from the package by the R function `tikz`.
+   */
+  options.luaDrawing = asLogical(CAR(args)); args = CDR(args);
+  options.luaCode = CHAR(asChar(CAR(args))); args = CDR(args);
+
+  /*
+   * The drawing commands of a page are split into fragment files that are
+   * read with \input once this many bytes have been written or this many
+   * primitives have been drawn. A value of 0 disables either limit.
+   */
+  options.fragmentSize = asInteger(CAR(args)); args = CDR(args);
+  options.fragmentPrimitives = asInteger(CAR(args)); args = CDR(args);
+
+  /*
+   * Should clipping scopes that repeat earlier ones, up to their position,
+   * be written once and reused?
+   */
+  options.reuseGroups = asLogical(CAR(args)); args = CDR(args);
+
+  /*
+   * May primitives that do not overlap be written in a different order so
+   * that those drawn with the same options end up next to each other?
+   */
+  options.reorderPrimitives = asLogical(CAR(args));
 
   /* Ensure there is an empty slot avaliable for a new device. */
   R_CheckDeviceAvailable();
@@ -190,7 +330,7 @@ SEXP TikZ_StartDevice ( SEXP args ){
     */
     if( !TikZ_Setup( deviceInfo, fileName, width, height, onefile, bg, fg, baseSize,
         standAlone, bareBones, documentDeclaration, packages,
-        footer, console, sanitize, engine ) ){
+        footer, console, sanitize, engine, options) ){
       /* 
        * If setup was unsuccessful, destroy the device and return
        * an error message.
@@ -234,7 +374,8 @@ static Rboolean TikZ_Setup(
   Rboolean standAlone, Rboolean bareBones,
   const char *documentDeclaration,
   const char *packages, const char *footer, 
-  Rboolean console, Rboolean sanitize, int engine ){
+  Rboolean console, Rboolean sanitize, int engine,
+  TikZ_Options options ){
 
   /* 
    * Create tikzInfo, this variable contains information which is
@@ -275,6 +416,19 @@ static Rboolean TikZ_Setup(
   }
   tikzInfo->engine = engine;
   tikzInfo->rasterFileCount = 1;
+
+  /*
+   * Data files are named after the output file in the same way as raster
+   * files. They are only written alongside output that goes to a file.
+   */
+  tikzInfo->dataThreshold = options.dataThreshold > 0 ?
+    options.dataThreshold : 0;
+  tikzInfo->dataFileCount = 1;
+  tikzInfo->dataFileName = (char*) calloc(strlen(fileName) +
+    TIKZ_DATA_SUFFIX_LENGTH, sizeof(char));
+  tikzInfo->data.data = NULL;
+  tikzInfo->data.length = 0;
+  tikzInfo->data.capacity = 0;
   tikzInfo->debug = DEBUG;
   tikzInfo->standAlone = standAlone;
   tikzInfo->bareBones = bareBones;
@@ -296,6 +450,247 @@ static Rboolean TikZ_Setup(
   tikzInfo->onefile = onefile;
   tikzInfo->pageNum = 1;
 
+  /*
+   * Output is collected in a buffer owned by the device and written out at the
+   * end of each page or whenever the buffer grows past `outputBufferSize`.
+   */
+  tikzInfo->output.data = NULL;
+  tikzInfo->output.length = 0;
+  tikzInfo->output.capacity = 0;
+  tikzInfo->outputBufferSize = options.outputBufferSize > 0 ?
+    options.outputBufferSize : 0;
+
+  /*
+   * Clamp the coordinate precision to the range the formatter supports. Note
+   * that R represents a missing integer using a large negative number.
+   */
+  if ( options.coordPrecision < 0 )
+    options.coordPrecision = 0;
+  if ( options.coordPrecision > TIKZ_MAX_PRECISION )
+    options.coordPrecision = TIKZ_MAX_PRECISION;
+  tikzInfo->coordPrecision = options.coordPrecision;
+  tikzInfo->coordScale = pow(10.0, options.coordPrecision);
+  tikzInfo->trimZeros = options.trimZeros == TRUE;
+
+  /*
+   * Lua code can only be run by LuaTeX. Shapes that are not painted by Lua
+   * are written with the PGF basic layer, whose options set up the graphics
+   * state for both.
+   */
+  tikzInfo->luaDrawing = options.luaDrawing == TRUE && engine == luatex;
+  tikzInfo->luaCode = (char*) calloc(strlen(options.luaCode) + 1, sizeof(char));
+  strcpy(tikzInfo->luaCode, options.luaCode);
+  tikzInfo->luaPath = FALSE;
+  tikzInfo->luaValues = 0;
+  if ( tikzInfo->luaDrawing )
+    options.pgfBasicLayer = TRUE;
+
+  /*
+   * The PGF basic layer has no counterpart to the relative coordinates,
+   * plot marks and occlusion culling that are built on the TikZ path syntax,
+   * so these are turned off when it is used.
+   */
+  tikzInfo->pgfBasicLayer = options.pgfBasicLayer == TRUE;
+  tikzInfo->pathOps = DRAWOP_NOOP;
+  tikzInfo->styleOps = DRAWOP_NOOP;
+  if ( tikzInfo->pgfBasicLayer ) {
+    options.relativeCoords = FALSE;
+    options.plotMarks = FALSE;
+    options.occlusionCulling = FALSE;
+  }
+  tikzInfo->relativeCoords = options.relativeCoords == TRUE;
+
+  /*
+   * Path options are assembled in the `style` buffer and then looked up in the
+   * `styles` dictionary to see if they have been used before.
+   */
+  tikzInfo->style.data = NULL;
+  tikzInfo->style.length = 0;
+  tikzInfo->style.capacity = 0;
+  tikzInfo->styleDictionary = options.styleDictionary == TRUE;
+  tikzInfo->styles.entries = NULL;
+  tikzInfo->styles.count = 0;
+  tikzInfo->styles.capacity = 0;
+  tikzInfo->styleCount = 0;
+
+  /*
+   * Scratch space used when the vertices of a line or polygon are filtered
+   * before being written. It is allocated on first use.
+   */
+  tikzInfo->simplifyTolerance = options.simplifyTolerance > 0 ?
+    options.simplifyTolerance : 0;
+  tikzInfo->dropRedundant = options.dropRedundant == TRUE;
+  tikzInfo->decimationWidth = options.decimationWidth > 0 ?
+    options.decimationWidth : 0;
+  tikzInfo->vertexX = NULL;
+  tikzInfo->vertexY = NULL;
+  tikzInfo->vertexStack = NULL;
+  tikzInfo->vertexKeep = NULL;
+  tikzInfo->vertexCapacity = 0;
+
+  /*
+   * No batch of shapes is open to start with. The options of the current batch
+   * are kept in `batchStyle` for comparison with those of the next shape.
+   */
+  tikzInfo->batchPrimitives = options.batchPrimitives == TRUE;
+  tikzInfo->batchKind = TIKZ_BATCH_NONE;
+  tikzInfo->batchStyle.data = NULL;
+  tikzInfo->batchStyle.length = 0;
+  tikzInfo->batchStyle.capacity = 0;
+  tikzInfo->batchMark = 0;
+
+  /*
+   * Scratch space for the pieces of lines and polygons that are cut at the
+   * edge of the clipping region. It is allocated on first use.
+   */
+  tikzInfo->clipPrimitives = options.clipPrimitives == TRUE;
+  tikzInfo->clippedX = NULL;
+  tikzInfo->clippedY = NULL;
+  tikzInfo->clippedSwapX = NULL;
+  tikzInfo->clippedSwapY = NULL;
+  tikzInfo->clippedRuns = NULL;
+  tikzInfo->clippedCapacity = 0;
+
+  /*
+   * Opaque shapes written to a page are recorded in `shapes` until the page
+   * is finished. No path has been started yet.
+   */
+  tikzInfo->occlusionCulling = options.occlusionCulling == TRUE;
+  tikzInfo->shapes = NULL;
+  tikzInfo->shapeCount = 0;
+  tikzInfo->shapeCapacity = 0;
+  tikzInfo->currentShape = -1;
+  tikzInfo->shapeVertices = NULL;
+  tikzInfo->shapeVertexCount = 0;
+  tikzInfo->shapeVertexCapacity = 0;
+  tikzInfo->pathStart = (size_t) -1;
+
+  /*
+   * Colors that have been given a name on the current page are kept in the
+   * `palette` dictionary. Without a palette, drawColor and fillColor are
+   * redefined as needed.
+   */
+  tikzInfo->colorPalette = options.colorPalette == TRUE;
+  tikzInfo->palette.entries = NULL;
+  tikzInfo->palette.count = 0;
+  tikzInfo->palette.capacity = 0;
+  tikzInfo->colorCount = 0;
+  strcpy(tikzInfo->drawColorName, "drawColor");
+  strcpy(tikzInfo->fillColorName, "fillColor");
+
+  /*
+   * Primitives drawn inside the current clipping region are counted. Those
+   * beyond the budget are painted onto `canvas`, which is allocated on first
+   * use.
+   */
+  tikzInfo->rasterBudget = options.rasterBudget > 0 ? options.rasterBudget : 0;
+  tikzInfo->rasterResolution = options.rasterResolution > 0 ?
+    options.rasterResolution : 300;
+  tikzInfo->regionPrimitives = 0;
+  tikzInfo->canvas.pixels = NULL;
+  tikzInfo->canvas.columns = 0;
+  tikzInfo->canvas.rows = 0;
+  tikzInfo->canvas.coverage = NULL;
+  tikzInfo->canvas.coverageCapacity = 0;
+  tikzInfo->crossings = NULL;
+  tikzInfo->crossingCapacity = 0;
+
+  /*
+   * Rectangles that may be cells of a grid are collected in `tiles`, with
+   * the cells they occupy in `tileCells`, until something else is drawn.
+   */
+  tikzInfo->rasterizeTiles = options.rasterizeTiles == TRUE;
+  tikzInfo->tiles = NULL;
+  tikzInfo->tileCount = 0;
+  tikzInfo->tileCapacity = 0;
+  tikzInfo->tileCells.entries = NULL;
+  tikzInfo->tileCells.count = 0;
+  tikzInfo->tileCells.capacity = 0;
+
+  /* Shapes seen so far are remembered in the `marks` dictionary. */
+  tikzInfo->plotMarks = options.plotMarks == TRUE;
+  tikzInfo->marks.entries = NULL;
+  tikzInfo->marks.count = 0;
+  tikzInfo->marks.capacity = 0;
+  tikzInfo->markCount = 0;
+
+  /*
+   * When output is kept in memory, nothing is written until the device is
+   * closed. No files are opened, just as for console output. The environment
+   * that will receive the output must be protected from garbage collection
+   * until then.
+   */
+  tikzInfo->memory = options.memory;
+  if ( options.memory != R_NilValue ) {
+    R_PreserveObject(options.memory);
+    tikzInfo->console = TRUE;
+  }
+
+  /*
+   * The background writer is only used for file output. The thread is started
+   * the first time there is output to write.
+   */
+#ifdef TIKZ_ASYNC_WRITE
+  tikzInfo->asyncWrite = options.asyncWrite == TRUE && !tikzInfo->console;
+  tikzInfo->pending.data = NULL;
+  tikzInfo->pending.length = 0;
+  tikzInfo->pending.capacity = 0;
+  tikzInfo->writerRunning = FALSE;
+  tikzInfo->writerStop = FALSE;
+  tikzInfo->writerError = FALSE;
+#else
+  tikzInfo->asyncWrite = FALSE;
+#endif
+
+  /*
+   * Fragment files are only written alongside output that goes to a file.
+   * Occlusion culling holds on to the whole page until it is finished, so
+   * there would be nothing to move into a fragment. While a fragment is
+   * open, the output file of the page is kept in `mainFile`.
+   */
+  tikzInfo->fragmentSize = options.fragmentSize > 0 ? options.fragmentSize : 0;
+  tikzInfo->fragmentPrimitives = options.fragmentPrimitives > 0 ?
+    options.fragmentPrimitives : 0;
+  if ( tikzInfo->console || tikzInfo->occlusionCulling ) {
+    tikzInfo->fragmentSize = 0;
+    tikzInfo->fragmentPrimitives = 0;
+  }
+  tikzInfo->fragmentFileCount = 1;
+  tikzInfo->fragmentDrawn = 0;
+  tikzInfo->fragmentWritten = 0;
+  tikzInfo->fragmentFileName = (char*) calloc(strlen(fileName) +
+    TIKZ_DATA_SUFFIX_LENGTH, sizeof(char));
+  tikzInfo->mainFile = NULL;
+
+  /*
+   * Clipping scopes are remembered in the `groups` dictionary while they are
+   * reused. Occlusion culling refers to positions in the output buffer, which
+   * move when a scope is replaced, and the PDF literals written by Lua do not
+   * follow the shift of a scope, so neither can be combined with reuse.
+   */
+  tikzInfo->reuseGroups = options.reuseGroups == TRUE &&
+    !tikzInfo->occlusionCulling && !tikzInfo->luaDrawing;
+  tikzInfo->groups.entries = NULL;
+  tikzInfo->groups.count = 0;
+  tikzInfo->groups.capacity = 0;
+  tikzInfo->groupCount = 0;
+  tikzInfo->groupStart = (size_t) -1;
+  tikzInfo->originX = 0;
+  tikzInfo->originY = 0;
+
+  /*
+   * Primitives waiting to be reordered are held in `held`, their vertices in
+   * `heldValues`. Both are allocated on first use.
+   */
+  tikzInfo->reorderPrimitives = options.reorderPrimitives == TRUE;
+  tikzInfo->heldReplay = FALSE;
+  tikzInfo->held = NULL;
+  tikzInfo->heldCount = 0;
+  tikzInfo->heldCapacity = 0;
+  tikzInfo->heldValues = NULL;
+  tikzInfo->heldValueCount = 0;
+  tikzInfo->heldValueCapacity = 0;
+
   /* Incorporate tikzInfo into deviceInfo. */
   deviceInfo->deviceSpecific = (void *) tikzInfo;
 
@@ -411,6 +806,12 @@ static Rboolean TikZ_Setup(
   deviceInfo->top = dim2dev( height );
   deviceInfo->right = dim2dev( width );
 
+  /* Until the graphics engine says otherwise, the whole canvas is visible. */
+  deviceInfo->clipBottom = deviceInfo->bottom;
+  deviceInfo->clipLeft = deviceInfo->left;
+  deviceInfo->clipTop = deviceInfo->top;
+  deviceInfo->clipRight = deviceInfo->right;
+
   /* Set default character size in pixels. */
   deviceInfo->cra[0] = 0.9 * baseSize;
   deviceInfo->cra[1] = 1.2 * baseSize;
@@ -545,10 +946,18 @@ static void TikZ_Close( pDevDesc deviceInfo){
   /* Shortcut pointers to variables of interest. */
   tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
 
+  TikZ_FlushHeld(deviceInfo);
+  TikZ_FlushTiles(deviceInfo);
+  TikZ_FlushCanvas(deviceInfo);
+  TikZ_EndBatch(tikzInfo);
+  TikZ_CullOccluded(deviceInfo);
+
   if ( tikzInfo->clipState == TIKZ_FINISH_CLIP ) {
+    TikZ_EndGroup(tikzInfo);
     printOutput(tikzInfo, "\\end{scope}\n");
     tikzInfo->clipState = TIKZ_NO_CLIP;
   }
+  TikZ_EndFragment(tikzInfo);
 
   /* End the tikz environment if we're not doing a bare bones plot. */
   if( tikzInfo->bareBones != TRUE && tikzInfo->pageState == TIKZ_FINISH_PAGE ) {
@@ -567,14 +976,63 @@ static void TikZ_Close( pDevDesc deviceInfo){
       "%% Calculated string width %d times\n",
       tikzInfo->stringWidthCalls);
 
+  /* Hand output that was collected in memory back to R. */
+  if ( tikzInfo->memory != R_NilValue ) {
+    SEXP output;
+    PROTECT( output = allocVector(RAWSXP, tikzInfo->output.length) );
+    memcpy(RAW(output), tikzInfo->output.data, tikzInfo->output.length);
+    defineVar(install("output"), output, tikzInfo->memory);
+    UNPROTECT(1);
+
+    R_ReleaseObject(tikzInfo->memory);
+    tikzInfo->memory = R_NilValue;
+    tikzInfo->output.length = 0;
+  }
+
   /* Close the file and destroy the tikzInfo structure. */
+  flushOutput(tikzInfo);
+  TikZ_StopWriter(tikzInfo);
   if(tikzInfo->console == FALSE)
     fclose(tikzInfo->outputFile);
 
   /* Deallocate pointers */
+  free(tikzInfo->output.data);
+  free(tikzInfo->style.data);
+  free(tikzInfo->batchStyle.data);
+  TikZ_DictionaryClear(&tikzInfo->styles);
+  free(tikzInfo->styles.entries);
+  TikZ_DictionaryClear(&tikzInfo->marks);
+  free(tikzInfo->marks.entries);
+  TikZ_DictionaryClear(&tikzInfo->palette);
+  free(tikzInfo->palette.entries);
+  free(tikzInfo->vertexX);
+  free(tikzInfo->vertexY);
+  free(tikzInfo->vertexStack);
+  free(tikzInfo->vertexKeep);
+  free(tikzInfo->clippedX);
+  free(tikzInfo->clippedY);
+  free(tikzInfo->clippedSwapX);
+  free(tikzInfo->clippedSwapY);
+  free(tikzInfo->clippedRuns);
+  free(tikzInfo->shapes);
+  free(tikzInfo->shapeVertices);
+  free(tikzInfo->canvas.pixels);
+  free(tikzInfo->canvas.coverage);
+  free(tikzInfo->crossings);
+  free(tikzInfo->tiles);
+  free(tikzInfo->held);
+  free(tikzInfo->heldValues);
+  TikZ_DictionaryClear(&tikzInfo->tileCells);
+  free(tikzInfo->tileCells.entries);
+  TikZ_DictionaryClear(&tikzInfo->groups);
+  free(tikzInfo->groups.entries);
   free(tikzInfo->outFileName);
   if ( !tikzInfo->onefile )
     free(tikzInfo->originalFileName);
+  free(tikzInfo->dataFileName);
+  free(tikzInfo->fragmentFileName);
+  free(tikzInfo->data.data);
+  free(tikzInfo->luaCode);
 
   free(tikzInfo->documentDeclaration);
   free(tikzInfo->packages);
@@ -588,10 +1046,19 @@ static void TikZ_NewPage( const pGEcontext plotParams, pDevDesc deviceInfo )
   /* Shortcut pointers to variables of interest. */
   tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
 
+  TikZ_FlushHeld(deviceInfo);
+  TikZ_FlushTiles(deviceInfo);
+  TikZ_FlushCanvas(deviceInfo);
+  tikzInfo->regionPrimitives = 0;
+  TikZ_EndBatch(tikzInfo);
+  TikZ_CullOccluded(deviceInfo);
+
   if ( tikzInfo->clipState == TIKZ_FINISH_CLIP ) {
+    TikZ_EndGroup(tikzInfo);
     printOutput(tikzInfo, "\\end{scope}\n");
     tikzInfo->clipState = TIKZ_NO_CLIP;
   }
+  TikZ_EndFragment(tikzInfo);
 
   if ( tikzInfo->pageState == TIKZ_FINISH_PAGE ) {
     if ( !tikzInfo->bareBones )
@@ -600,9 +1067,14 @@ static void TikZ_NewPage( const pGEcontext plotParams, pDevDesc deviceInfo )
     if ( !tikzInfo->onefile ) {
       if( tikzInfo->standAlone )
         printOutput(tikzInfo,"\n\\end{document}\n");
+    }
 
-      if( !tikzInfo->console )
-        fclose(tikzInfo->outputFile);
+    /* The page is finished, so hand everything collected so far to the OS. */
+    flushOutput(tikzInfo);
+
+    if ( !tikzInfo->onefile && !tikzInfo->console ) {
+      TikZ_WaitForWriter(tikzInfo);
+      fclose(tikzInfo->outputFile);
     }
   }
 
@@ -610,9 +1082,22 @@ static void TikZ_NewPage( const pGEcontext plotParams, pDevDesc deviceInfo )
    * Color definitions do not persist accross tikzpicture environments. Set the
    * cached colors to "impossible" values so that the first drawing operation
    * inside the next environment will trigger a re-definition of colors.
+   * Styles and plot marks created with \tikzset are forgotten for the same
+   * reason. Palette colors are defined globally, but a new page may end up in
+   * a file of its own, so the palette starts over as well.
    */
   tikzInfo->oldFillColor = -999;
   tikzInfo->oldDrawColor = -999;
+  TikZ_DictionaryClear(&tikzInfo->styles);
+  TikZ_DictionaryClear(&tikzInfo->marks);
+  TikZ_DictionaryClear(&tikzInfo->palette);
+
+  /*
+   * Reused scopes are defined globally and so carry over to the following
+   * pages of the same file, but not to the next file.
+   */
+  if ( !tikzInfo->onefile )
+    TikZ_DictionaryClear(&tikzInfo->groups);
 
   /*
    * Setting this flag will cause the `TikZ_CheckState` function to emit the
@@ -627,29 +1112,89 @@ static void TikZ_Clip( double x0, double x1,
 {
   /* Shortcut pointers to variables of interest. */
   tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
+  double scale = tikzInfo->coordScale;
+  Rboolean wholeDevice;
+
+  /*
+   * Primitives held back for reordering or as cells of a grid must be written
+   * while the region they were drawn in is still in place.
+   */
+  if ( x0 != deviceInfo->clipLeft || x1 != deviceInfo->clipRight ||
+      y0 != deviceInfo->clipBottom || y1 != deviceInfo->clipTop ) {
+    TikZ_FlushHeld(deviceInfo);
+    TikZ_FlushTiles(deviceInfo);
+  }
 
   deviceInfo->clipBottom = y0;
   deviceInfo->clipLeft = x0;
   deviceInfo->clipTop = y1;
   deviceInfo->clipRight = x1;
 
-  if ( tikzInfo->clipState == TIKZ_FINISH_CLIP )
-    printOutput(tikzInfo, "\\end{scope}\n");
+  /*
+   * The graphics engine sets the clipping region far more often than it
+   * changes. Compare the new region with the active one, as it would be
+   * written to the output, and leave the current scope alone if they match.
+   */
+  x0 = nearbyint(x0 * scale);
+  x1 = nearbyint(x1 * scale);
+  y0 = nearbyint(y0 * scale);
+  y1 = nearbyint(y1 * scale);
+
+  if ( tikzInfo->clipState != TIKZ_NO_CLIP && x0 == tikzInfo->clipX0 &&
+      x1 == tikzInfo->clipX1 && y0 == tikzInfo->clipY0 && y1 == tikzInfo->clipY1 )
+    return;
 
   /*
-   * Color definitions do not persist accross scopes. Set the cached colors to
-   * "impossible" values so that the first drawing operation inside the scope
-   * will trigger a re-definition of colors.
+   * Primitives painted onto an image belong to the region that is being left
+   * and the budget starts over for the new one.
    */
-  tikzInfo->oldFillColor = -999;
-  tikzInfo->oldDrawColor = -999;
+  TikZ_FlushCanvas(deviceInfo);
+  tikzInfo->regionPrimitives = 0;
+
+  /*
+   * A region that covers the whole device clips nothing, so no scope is
+   * needed for it at all.
+   */
+  wholeDevice =
+    fmin(x0, x1) <= nearbyint(fmin(deviceInfo->left, deviceInfo->right) * scale) &&
+    fmax(x0, x1) >= nearbyint(fmax(deviceInfo->left, deviceInfo->right) * scale) &&
+    fmin(y0, y1) <= nearbyint(fmin(deviceInfo->bottom, deviceInfo->top) * scale) &&
+    fmax(y0, y1) >= nearbyint(fmax(deviceInfo->bottom, deviceInfo->top) * scale);
+
+  if ( wholeDevice && tikzInfo->clipState != TIKZ_FINISH_CLIP ) {
+    tikzInfo->clipState = TIKZ_NO_CLIP;
+    return;
+  }
+
+  tikzInfo->clipX0 = x0;
+  tikzInfo->clipX1 = x1;
+  tikzInfo->clipY0 = y0;
+  tikzInfo->clipY1 = y1;
+
+  TikZ_EndBatch(tikzInfo);
+
+  if ( tikzInfo->clipState == TIKZ_FINISH_CLIP ) {
+    TikZ_EndGroup(tikzInfo);
+    printOutput(tikzInfo, "\\end{scope}\n");
+
+    /*
+     * Color definitions do not persist accross scopes. Set the cached colors
+     * to "impossible" values so that the first drawing operation after the
+     * scope will trigger a re-definition of colors. Styles and plot marks
+     * created with \tikzset are also local to the scope they were defined in.
+     */
+    tikzInfo->oldFillColor = -999;
+    tikzInfo->oldDrawColor = -999;
+    TikZ_DictionaryClear(&tikzInfo->styles);
+    TikZ_DictionaryClear(&tikzInfo->marks);
+  }
 
   /*
    * Setting this flag will cause the `TikZ_CheckState` function to emit the
    * code required to begin a new clipping scope. `TikZ_CheckState` is called
    * by every graphics function that generates visible output.
    */
-  tikzInfo->clipState = TIKZ_START_CLIP;
+  tikzInfo->clipState = wholeDevice ? TIKZ_NO_CLIP : TIKZ_START_CLIP;
 }
 
 static void TikZ_Size( double *left, double *right,
@@ -1002,6 +1547,10 @@ static void TikZ_Text( double x, double y, const char *str,
   
   /* Shortcut pointers to variables of interest. */
   tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
+
+  TikZ_FlushHeld(deviceInfo);
+  TikZ_FlushTiles(deviceInfo);
+  TikZ_EndBatch(tikzInfo);
   
   double tol = 0.01;
   
@@ -1039,11 +1588,13 @@ static void TikZ_Text( double x, double y, const char *str,
       "%% Drawing node at x = %f, y = %f\n",
       x,y);
 
+  /* Text stays in the output and must end up above primitives painted so far. */
+  TikZ_FlushCanvas(deviceInfo);
   TikZ_CheckState(deviceInfo);
   TikZ_DefineColors(plotParams, deviceInfo, DRAWOP_DRAW);
 
   /* Start a node for the text, open an options bracket. */
-  printOutput(tikzInfo,"\n\\node[text=drawColor");
+  printOutput(tikzInfo,"\n\\node[text=%s", tikzInfo->drawColorName);
   /* FIXME: Should bail out of this function early if text is fully transparent */
   if( !R_OPAQUE(plotParams->col) )
     printOutput(tikzInfo, ",text opacity=%4.2f", R_ALPHA(plotParams->col)/255.0);
@@ -1070,8 +1621,9 @@ static void TikZ_Text( double x, double y, const char *str,
   }
 
   printOutput(tikzInfo,
-    ",inner sep=0pt, outer sep=0pt, scale=%6.2f] at (%6.2f,%6.2f) {",
-    fontScale, x, y);
+    ",inner sep=0pt, outer sep=0pt, scale=%6.2f] at ", fontScale);
+  printCoordinate(tikzInfo, x, y);
+  printOutput(tikzInfo, " {");
 
   char *cleanString = NULL;
   if(tikzInfo->sanitize == TRUE){
@@ -1098,7 +1650,7 @@ static void TikZ_Text( double x, double y, const char *str,
   if( DEBUG == TRUE )
     printOutput(tikzInfo, 
       "\n\\draw[color=red, fill=red] (%6.2f,%6.2f) circle (0.5pt);\n", 
-      x, y);
+      x - tikzInfo->originX, y - tikzInfo->originY);
 
 }
 
@@ -1110,6 +1662,9 @@ static void TikZ_Circle( double x, double y, double r,
   tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
   TikZ_DrawOps ops = TikZ_GetDrawOps(plotParams);
 
+  if ( TikZ_HoldPrimitive(plotParams, deviceInfo, TIKZ_HELD_CIRCLE, 1, &x, &y, r) )
+    return;
+
   /*Show only for debugging*/
   if(tikzInfo->debug == TRUE) 
     printOutput(tikzInfo,
@@ -1117,20 +1672,84 @@ static void TikZ_Circle( double x, double y, double r,
       x,y,r);
 
   TikZ_CheckState(deviceInfo);
+  if ( TikZ_Culled(plotParams, deviceInfo, ops, x - r, y - r, x + r, y + r) )
+    return;
+
+  if ( TikZ_Rasterize(deviceInfo, 1) ) {
+    TikZ_PaintCircle(tikzInfo, plotParams, ops, x, y, r);
+    return;
+  }
+
   TikZ_DefineColors(plotParams, deviceInfo, ops);
 
-  /* Start drawing, open an options bracket. */
-  printOutput(tikzInfo,"\n\\path[");
+  TikZ_Shape *shape = TikZ_RecordShape(plotParams, deviceInfo, ops,
+    x - r, y - r, x + r, y + r);
+  if ( shape != NULL ) {
+    /*
+     * The stroke of a circle reaches exactly half the line width, which is
+     * written rounded to a tenth of a point, past its outline.
+     */
+    double halfWidth = (ops & DRAWOP_DRAW) ? 0.2 * plotParams->lwd : 0;
+    shape->circle = TRUE;
+    shape->x = x;
+    shape->y = y;
+    shape->r = r + halfWidth + 0.05 + 3.0 / tikzInfo->coordScale;
+    if ( ops & DRAWOP_FILL ) {
+      shape->occluder = TIKZ_OCCLUDER_CIRCLE;
+      shape->inner = r + fmax(halfWidth - 0.05, 0);
+    }
+  }
+
+  /*
+   * Start drawing, open an options bracket. If the previous shape was a circle
+   * drawn with the same options, add this one to its path instead.
+   */
   TikZ_WriteDrawOptions(plotParams, deviceInfo, ops);
+  if ( TikZ_ContinueBatch(plotParams, tikzInfo, ops, TIKZ_BATCH_CIRCLE, 0,
+      x - r, y - r, x + r, y + r) ) {
+    TikZ_ShapeStart(tikzInfo);
+    if ( !tikzInfo->luaDrawing )
+      printOutput(tikzInfo, "\n\t");
+  } else {
+    TikZ_StartPath(tikzInfo);
+    if ( tikzInfo->luaDrawing )
+      TikZ_StartLua(tikzInfo, TRUE, TRUE, FALSE);
+    else
+      TikZ_EndOptions(tikzInfo, " ");
+    TikZ_ShapeStart(tikzInfo);
+  }
 
-  /* End options, print coordinates. */
-  printOutput(tikzInfo, "] (%6.2f,%6.2f) circle (%6.2f);\n",
-    x,y,r);
+  /* Print coordinates. */
+  if ( tikzInfo->luaDrawing )
+    printLuaCircle(tikzInfo, x, y, r);
+  else
+    printCircle(tikzInfo, x, y, r);
+  TikZ_ShapeEnd(tikzInfo);
+  TikZ_FinishShape(tikzInfo);
 }
 
 static void TikZ_Rectangle( double x0, double y0,
     double x1, double y1, const pGEcontext plotParams, pDevDesc deviceInfo){
 
+  double heldX[2] = { x0, x1 }, heldY[2] = { y0, y1 };
+  if ( TikZ_HoldPrimitive(plotParams, deviceInfo, TIKZ_HELD_RECTANGLE, 2,
+      heldX, heldY, 0) )
+    return;
+
+  /*
+   * The cells of an image or heatmap are held back so that a whole grid of
+   * them can be written as a single raster.
+   */
+  if ( TikZ_CollectTile(x0, y0, x1, y1, plotParams, deviceInfo) )
+    return;
+
+  TikZ_WriteRectangle(x0, y0, x1, y1, plotParams, deviceInfo);
+
+}
+
+static void TikZ_WriteRectangle( double x0, double y0,
+    double x1, double y1, const pGEcontext plotParams, pDevDesc deviceInfo){
+
   /* Shortcut pointers to variables of interest. */
   tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
   TikZ_DrawOps ops = TikZ_GetDrawOps(plotParams);
@@ -1142,16 +1761,78 @@ static void TikZ_Rectangle( double x0, double y0,
       x0,y0,x1,y1);
 
   TikZ_CheckState(deviceInfo);
+  if ( TikZ_Culled(plotParams, deviceInfo, ops,
+      fmin(x0, x1), fmin(y0, y1), fmax(x0, x1), fmax(y0, y1)) )
+    return;
+
+  /*
+   * Square plot symbols count against the raster budget. Larger rectangles,
+   * like legend boxes and the frame of a plot, stay vector graphics and are
+   * painted over anything rasterized before them.
+   */
+  if ( !TikZ_SymbolSized(plotParams,
+      fmin(x0, x1), fmin(y0, y1), fmax(x0, x1), fmax(y0, y1)) ) {
+    TikZ_FlushCanvas(deviceInfo);
+  } else if ( TikZ_Rasterize(deviceInfo, 1) ) {
+    double cornersX[4] = { x0, x1, x1, x0 }, cornersY[4] = { y0, y0, y1, y1 };
+    int corners = 4;
+    TikZ_PaintShape(tikzInfo, plotParams, ops, 1, &corners, cornersX, cornersY,
+      TRUE, TRUE);
+    return;
+  }
+
   TikZ_DefineColors(plotParams, deviceInfo, ops);
 
-  /* Start drawing, open an options bracket. */
-  printOutput(tikzInfo,"\n\\path[");
+  TikZ_Shape *shape = TikZ_RecordShape(plotParams, deviceInfo, ops,
+    fmin(x0, x1), fmin(y0, y1), fmax(x0, x1), fmax(y0, y1));
+  if ( shape != NULL && (ops & DRAWOP_FILL) ) {
+    double cornersX[4] = { x0, x1, x1, x0 }, cornersY[4] = { y0, y0, y1, y1 };
+    TikZ_SetPolygonOccluder(tikzInfo, shape, 4, cornersX, cornersY);
+  }
+
+  /*
+   * Rectangles that share a path must all wind the same way, otherwise the
+   * nonzero rule leaves holes where they overlap. Swapping the y coordinates
+   * reverses the direction but moves the corner the outline starts from,
+   * which shifts a dash pattern. Dashed rectangles that would need this are
+   * drawn on their own instead.
+   */
+  Rboolean batchable = TRUE;
+  if ( tikzInfo->batchPrimitives && (x1 - x0) * (y1 - y0) < 0 ) {
+    if ( plotParams->lty <= 1 || !(ops & DRAWOP_DRAW) ) {
+      double swap = y0;
+      y0 = y1;
+      y1 = swap;
+    } else {
+      batchable = FALSE;
+      TikZ_EndBatch(tikzInfo);
+    }
+  }
+
+  /*
+   * Start drawing, open an options bracket. Bars of a bar chart or histogram
+   * drawn with the same options are added to the open path.
+   */
   TikZ_WriteDrawOptions(plotParams, deviceInfo, ops);
+  if ( batchable && TikZ_ContinueBatch(plotParams, tikzInfo, ops,
+      TIKZ_BATCH_RECTANGLE, 0, fmin(x0, x1), fmin(y0, y1), fmax(x0, x1),
+      fmax(y0, y1)) ) {
+    TikZ_ShapeStart(tikzInfo);
+    printOutput(tikzInfo, "\n\t");
+  } else {
+    TikZ_StartPath(tikzInfo);
+    TikZ_EndOptions(tikzInfo, " ");
+    TikZ_ShapeStart(tikzInfo);
+  }
+
+  /* Print coordinates. */
+  printRectangle(tikzInfo, x0, y0, x1, y1);
+  TikZ_ShapeEnd(tikzInfo);
 
-  /* End options, print coordinates. */
-  printOutput(tikzInfo, 
-    "] (%6.2f,%6.2f) rectangle (%6.2f,%6.2f);\n",
-    x0,y0,x1,y1);
+  if ( batchable )
+    TikZ_FinishShape(tikzInfo);
+  else
+    TikZ_EndPath(tikzInfo);
 
 }
 
@@ -1161,7 +1842,12 @@ static void TikZ_Line( double x1, double y1,
 
   /* Shortcut pointers to variables of interest. */
   tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
-  TikZ_DrawOps ops = TikZ_GetDrawOps(plotParams);
+  TikZ_DrawOps ops = TikZ_GetDrawOps(plotParams) & DRAWOP_DRAW;
+
+  double heldX[2] = { x1, x2 }, heldY[2] = { y1, y2 };
+  if ( TikZ_HoldPrimitive(plotParams, deviceInfo, TIKZ_HELD_LINE, 2,
+      heldX, heldY, 0) )
+    return;
 
   /*Show only for debugging*/
   if(tikzInfo->debug == TRUE) 
@@ -1170,15 +1856,72 @@ static void TikZ_Line( double x1, double y1,
       x1,y1,x2,y2);
 
   TikZ_CheckState(deviceInfo);
+
+  /*
+   * Lines that miss the clipping region are not written. Solid lines that
+   * cross its edge are shortened to the part that can be seen. Dashed lines
+   * are kept whole, moving their start would shift the dash pattern.
+   */
+  double region[4];
+  if ( TikZ_VisibleRegion(plotParams, deviceInfo, ops, region) ) {
+    double cx1 = x1, cy1 = y1, cx2 = x2, cy2 = y2;
+    if ( !clipSegment(region, &cx1, &cy1, &cx2, &cy2) )
+      return;
+    if ( plotParams->lty <= 1 ) {
+      x1 = cx1; y1 = cy1;
+      x2 = cx2; y2 = cy2;
+    }
+  }
+
+  if ( TikZ_Rasterize(deviceInfo, 1) ) {
+    double endsX[2] = { x1, x2 }, endsY[2] = { y1, y2 };
+    int ends = 2;
+    TikZ_PaintShape(tikzInfo, plotParams, ops, 1, &ends, endsX, endsY,
+      FALSE, TRUE);
+    return;
+  }
+
   TikZ_DefineColors(plotParams, deviceInfo, ops);
 
-  /* Start drawing a line, open an options bracket. */
-  printOutput(tikzInfo,"\n\\path[");
+  /*
+   * Start drawing a line, open an options bracket. Lines drawn with the same
+   * options as the one before them, such as grid lines or the pieces of a
+   * contour, are added to the open path.
+   */
+  Rboolean joined = FALSE;
   TikZ_WriteDrawOptions(plotParams, deviceInfo, ops);
+  if ( TikZ_ContinueBatch(plotParams, tikzInfo, ops, TIKZ_BATCH_LINE, 0,
+      fmin(x1, x2), fmin(y1, y2), fmax(x1, x2), fmax(y1, y2)) ) {
+
+    /*
+     * A line that starts where the previous one ended is joined onto it. With
+     * round caps and joins the result is indistinguishable from two separate
+     * lines. Other caps and joins would change the look of the corner and a
+     * dash pattern would carry over from one line to the next, so such lines
+     * are started as a new subpath instead.
+     */
+    if ( plotParams->lend == GE_ROUND_CAP && plotParams->ljoin == GE_ROUND_JOIN &&
+        plotParams->lty <= 1 &&
+        nearbyint(x1 * tikzInfo->coordScale) == tikzInfo->batchEndX &&
+        nearbyint(y1 * tikzInfo->coordScale) == tikzInfo->batchEndY ) {
+      printOutput(tikzInfo, tikzInfo->pgfBasicLayer ? "\n\t" : " --\n\t");
+      joined = TRUE;
+    } else {
+      printOutput(tikzInfo, "\n\t");
+    }
+
+  } else {
+    TikZ_StartPath(tikzInfo);
+
+    /* End options. */
+    TikZ_EndOptions(tikzInfo, " ");
+  }
 
-  /* End options, print coordinates. */
-  printOutput(tikzInfo, "] (%6.2f,%6.2f) -- (%6.2f,%6.2f);\n",
-    x1,y1,x2,y2);
+  /* Print coordinates. */
+  printSegment(tikzInfo, x1, y1, x2, y2, joined);
+  tikzInfo->batchEndX = nearbyint(x2 * tikzInfo->coordScale);
+  tikzInfo->batchEndY = nearbyint(y2 * tikzInfo->coordScale);
+  TikZ_FinishShape(tikzInfo);
 
 }
 
@@ -1199,34 +1942,86 @@ static void TikZ_Polyline( int n, double *x, double *y,
    */
   TikZ_DrawOps ops = TikZ_GetDrawOps(plotParams) & DRAWOP_DRAW;
 
+  if ( TikZ_HoldPrimitive(plotParams, deviceInfo, TIKZ_HELD_POLYLINE, n, x, y, 0) )
+    return;
+
   /*Show only for debugging*/
   if(tikzInfo->debug == TRUE) 
     printOutput(tikzInfo,
       "%% Starting Polyline\n");
 
   TikZ_CheckState(deviceInfo);
-  TikZ_DefineColors(plotParams, deviceInfo, ops);
-
-  /* Start drawing, open an options bracket. */
-  printOutput(tikzInfo,"\n\\path[");
-  TikZ_WriteDrawOptions(plotParams, deviceInfo, ops);
 
-  /* End options, print first set of coordinates. */
-  printOutput(tikzInfo, "] (%6.2f,%6.2f) --\n",
-    x[0],y[0]);
-  
-  /* Print coordinates for the middle segments of the line. */
-  int i;
-  for ( i = 1; i < n-1; i++ ){
-    
-    printOutput(tikzInfo, "\t(%6.2f,%6.2f) --\n",
-      x[i],y[i]);
+  /*
+   * Lines that miss the clipping region are not written. Solid lines that
+   * leave it are cut into the pieces that lie inside, each of which is
+   * written as a subpath of its own. Dashed lines are kept whole so that
+   * their dash pattern is not shifted.
+   */
+  double region[4];
+  TikZ_OverlapKind overlap = TIKZ_INSIDE;
+  int pieces = 0, piece, start;
+  if ( TikZ_VisibleRegion(plotParams, deviceInfo, ops, region) ) {
+    overlap = TikZ_Overlap(region, n, x, y);
+    if ( overlap == TIKZ_CROSSING && plotParams->lty <= 1 ) {
+      pieces = clipPolyline(tikzInfo, region, n, x, y);
+      if ( pieces == 0 )
+        overlap = TIKZ_OUTSIDE;
+    }
+  }
 
+  /*
+   * Lines, such as fitted curves and other annotations, stay vector graphics
+   * and are painted over anything rasterized before them.
+   */
+  if ( overlap != TIKZ_OUTSIDE ) {
+    TikZ_FlushCanvas(deviceInfo);
+    TikZ_DefineColors(plotParams, deviceInfo, ops);
+    TikZ_WriteDrawOptions(plotParams, deviceInfo, ops);
   }
 
-  /* Print last set of coordinates. End path. */
-  printOutput(tikzInfo, "\t(%6.2f,%6.2f);\n",
-    x[n-1],y[n-1]);
+  if ( pieces > 0 ) {
+    /* Start drawing, open an options bracket. */
+    TikZ_EndBatch(tikzInfo);
+    TikZ_StartPath(tikzInfo);
+    if ( tikzInfo->luaDrawing )
+      TikZ_StartLua(tikzInfo, FALSE, FALSE, FALSE);
+    else
+      TikZ_EndOptions(tikzInfo, " ");
+
+    /* Print the coordinates of each piece. End path. */
+    for ( piece = 0, start = 0; piece < pieces; piece++ ) {
+      n = TikZ_PrepareVertices(tikzInfo, tikzInfo->clippedRuns[piece],
+        tikzInfo->clippedX + start, tikzInfo->clippedY + start, FALSE, &x, &y);
+      start += tikzInfo->clippedRuns[piece];
+
+      if ( tikzInfo->luaDrawing ) {
+        printLuaSubpath(tikzInfo, n, x, y);
+        continue;
+      }
+      if ( piece > 0 )
+        printOutput(tikzInfo, "\n\t");
+      printPolyline(tikzInfo, n, x, y);
+    }
+    TikZ_EndPath(tikzInfo);
+  } else if ( overlap != TIKZ_OUTSIDE ) {
+    n = TikZ_PrepareVertices(tikzInfo, n, x, y, FALSE, &x, &y);
+    if ( !TikZ_WriteMark(plotParams, tikzInfo, ops, n, x, y, FALSE) ) {
+      /* Start drawing, open an options bracket. */
+      TikZ_EndBatch(tikzInfo);
+      TikZ_StartPath(tikzInfo);
+
+      /* End options, print the coordinates of the line. End path. */
+      if ( tikzInfo->luaDrawing ) {
+        TikZ_StartLua(tikzInfo, FALSE, FALSE, FALSE);
+        printLuaSubpath(tikzInfo, n, x, y);
+      } else {
+        TikZ_EndOptions(tikzInfo, " ");
+        printPolyline(tikzInfo, n, x, y);
+      }
+      TikZ_EndPath(tikzInfo);
+    }
+  }
     
   /*Show only for debugging*/
   if(tikzInfo->debug == TRUE) 
@@ -1242,33 +2037,87 @@ static void TikZ_Polygon( int n, double *x, double *y,
   tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
   TikZ_DrawOps ops = TikZ_GetDrawOps(plotParams);
 
+  if ( TikZ_HoldPrimitive(plotParams, deviceInfo, TIKZ_HELD_POLYGON, n, x, y, 0) )
+    return;
+
   /*Show only for debugging*/
   if(tikzInfo->debug == TRUE) 
     printOutput(tikzInfo,
       "%% Starting Polygon\n");
 
   TikZ_CheckState(deviceInfo);
-  TikZ_DefineColors(plotParams, deviceInfo, ops);
 
-  /* Start drawing, open an options bracket. */
-  printOutput(tikzInfo,"\n\\path[");
-  TikZ_WriteDrawOptions(plotParams, deviceInfo, ops);
+  /*
+   * Polygons that miss the clipping region are not written. Those that
+   * cross its edge are cut down to the part inside of it, unless they are
+   * outlined with a dash pattern that would be shifted by this.
+   */
+  double region[4];
+  TikZ_OverlapKind overlap = TIKZ_INSIDE;
+  if ( TikZ_VisibleRegion(plotParams, deviceInfo, ops, region) ) {
+    overlap = TikZ_Overlap(region, n, x, y);
+    if ( overlap == TIKZ_CROSSING &&
+        (plotParams->lty <= 1 || !(ops & DRAWOP_DRAW)) ) {
+      n = clipPolygon(tikzInfo, region, n, x, y);
+      x = tikzInfo->clippedX;
+      y = tikzInfo->clippedY;
+      if ( n < 3 )
+        overlap = TIKZ_OUTSIDE;
+    }
+  }
 
-  /* End options, print first set of coordinates. */
-  printOutput(tikzInfo, "] (%6.2f,%6.2f) --\n",
-    x[0],y[0]);
-  
-  /* Print coordinates for the middle segments of the line. */
-  int i;
-  for ( i = 1; i < n; i++ ){
-    
-    printOutput(tikzInfo, "\t(%6.2f,%6.2f) --\n",
-      x[i],y[i]);
+  /*
+   * Plot symbols arrive as small polygons and count against the raster
+   * budget. Larger polygons stay vector graphics and are painted over
+   * anything rasterized before them.
+   */
+  if ( overlap != TIKZ_OUTSIDE ) {
+    double left = x[0], bottom = y[0], right = x[0], top = y[0];
+    int i;
+    for ( i = 1; i < n; i++ ) {
+      left = fmin(left, x[i]);
+      right = fmax(right, x[i]);
+      bottom = fmin(bottom, y[i]);
+      top = fmax(top, y[i]);
+    }
 
+    if ( n > TIKZ_MAX_MARK_VERTICES ||
+        !TikZ_SymbolSized(plotParams, left, bottom, right, top) ) {
+      TikZ_FlushCanvas(deviceInfo);
+    } else if ( TikZ_Rasterize(deviceInfo, 1) ) {
+      TikZ_PaintShape(tikzInfo, plotParams, ops, 1, &n, x, y, TRUE, TRUE);
+      return;
+    }
   }
 
-  /* End path by cycling to first set of coordinates. */
-  printOutput(tikzInfo, "\tcycle;\n" );
+  if ( overlap != TIKZ_OUTSIDE ) {
+    TikZ_DefineColors(plotParams, deviceInfo, ops);
+    TikZ_WriteDrawOptions(plotParams, deviceInfo, ops);
+
+    n = TikZ_PrepareVertices(tikzInfo, n, x, y, TRUE, &x, &y);
+    TikZ_RecordPolygon(plotParams, deviceInfo, ops, n, x, y);
+    if ( !TikZ_WriteMark(plotParams, tikzInfo, ops, n, x, y, TRUE) ) {
+      /* Start drawing, open an options bracket. */
+      TikZ_EndBatch(tikzInfo);
+      TikZ_StartPath(tikzInfo);
+
+      /* End options, print the coordinates of the polygon. */
+      if ( tikzInfo->luaDrawing ) {
+        TikZ_StartLua(tikzInfo, FALSE, TRUE, FALSE);
+        printLuaSubpath(tikzInfo, n, x, y);
+        TikZ_EndPath(tikzInfo);
+      } else {
+        TikZ_EndOptions(tikzInfo, " ");
+        TikZ_ShapeStart(tikzInfo);
+        printPolyline(tikzInfo, n, x, y);
+
+        /* End path by cycling to first set of coordinates. */
+        printCycle(tikzInfo);
+        TikZ_ShapeEnd(tikzInfo);
+        TikZ_EndPath(tikzInfo);
+      }
+    }
+  }
 
   /*Show only for debugging*/
   if(tikzInfo->debug == TRUE) 
@@ -1285,13 +2134,29 @@ TikZ_Path( double *x, double *y,
   const pGEcontext plotParams, pDevDesc deviceInfo
 ){
 
-  int i, j, index;
+  int i, index, count;
+  double *subX, *subY, region[4];
   tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
   TikZ_DrawOps ops = TikZ_GetDrawOps(plotParams);
 
+  TikZ_FlushHeld(deviceInfo);
+  TikZ_FlushTiles(deviceInfo);
+  TikZ_EndBatch(tikzInfo);
+
   if(tikzInfo->debug) { printOutput(tikzInfo, "%% Drawing polypath with %i subpaths\n", npoly); }
 
   TikZ_CheckState(deviceInfo);
+
+  /* Paths whose subpaths all miss the clipping region are not written. */
+  if ( TikZ_VisibleRegion(plotParams, deviceInfo, ops, region) ) {
+    for ( i = 0, count = 0; i < npoly; i++ )
+      count += nper[i];
+    if ( TikZ_Overlap(region, count, x, y) == TIKZ_OUTSIDE )
+      return;
+  }
+
+  /* Paths stay vector graphics, painted over anything rasterized before. */
+  TikZ_FlushCanvas(deviceInfo);
   TikZ_DefineColors(plotParams, deviceInfo, ops);
 
   /*
@@ -1302,7 +2167,6 @@ TikZ_Path( double *x, double *y,
    *
    * Thank you TikZ!
    */
-  printOutput(tikzInfo,"\n\\path[");
   TikZ_WriteDrawOptions(plotParams, deviceInfo, ops);
 
   /*
@@ -1310,13 +2174,19 @@ TikZ_Path( double *x, double *y,
    * parameter. See the "Graphic Parameters: Interior Rules" section of the PGF
    * manual for details.
    */
-  if (winding) {
-    printOutput(tikzInfo, ",nonzero rule");
+  if ( tikzInfo->pgfBasicLayer ) {
+    printStyle(tikzInfo, winding ? "\\pgfsetnonzerorule" : "\\pgfseteorule");
+  } else if (winding) {
+    printStyle(tikzInfo, ",nonzero rule");
   } else {
-    printOutput(tikzInfo, ",even odd rule");
+    printStyle(tikzInfo, ",even odd rule");
   }
 
-  printOutput(tikzInfo, "]");
+  TikZ_StartPath(tikzInfo);
+  if ( tikzInfo->luaDrawing )
+    TikZ_StartLua(tikzInfo, FALSE, TRUE, !winding);
+  else
+    TikZ_EndOptions(tikzInfo, "\n\t");
 
 
   /* Draw polygons */
@@ -1325,20 +2195,24 @@ TikZ_Path( double *x, double *y,
 
     if(tikzInfo->debug) { printOutput(tikzInfo, "\n%% Drawing subpath: %i\n", i); }
 
-    printOutput(tikzInfo, "\n\t(%6.2f,%6.2f) --\n", x[index],y[index]);
-    index++;
+    count = TikZ_PrepareVertices(tikzInfo, nper[i], x + index, y + index,
+      TRUE, &subX, &subY);
+    index += nper[i];
 
-    for (j = 1; j < nper[i]; j++) {
-      printOutput(tikzInfo, "\t(%6.2f,%6.2f) --\n", x[index],y[index]);
-      index++;
+    if ( tikzInfo->luaDrawing ) {
+      printLuaSubpath(tikzInfo, count, subX, subY);
+      continue;
     }
 
-    printOutput(tikzInfo, "\tcycle" );
+    if ( i > 0 )
+      printOutput(tikzInfo, "\n\t");
+    printPolyline(tikzInfo, count, subX, subY);
+    printCycle(tikzInfo);
 
   }
 
   /* Close the \filldraw command */
-  printOutput(tikzInfo, ";\n");
+  TikZ_EndPath(tikzInfo);
 
 }
 
@@ -1368,6 +2242,17 @@ static void TikZ_Raster(
   /* Shortcut pointer to device information. */
   tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
 
+  /*
+   * Primitives painted so far go underneath the image. The canvas is itself
+   * written through this function, `TikZ_FlushCanvas` marks it as empty
+   * before doing so. The same goes for rectangles held back as a grid and
+   * primitives held back for reordering.
+   */
+  TikZ_FlushHeld(deviceInfo);
+  TikZ_FlushTiles(deviceInfo);
+  TikZ_FlushCanvas(deviceInfo);
+  TikZ_EndBatch(tikzInfo);
+
   /*
    * Recover package namespace as the raster output function is not exported
    * into the global environment.
@@ -1531,7 +2416,7 @@ static void TikZ_Raster(
 
   /* Position the image using a node */
   printOutput(tikzInfo, "\\node[inner sep=0pt,outer sep=0pt,anchor=south west,rotate=%6.2f] at (%6.2f, %6.2f) {\n",
-    rot, x, y);
+    rot, x - tikzInfo->originX, y - tikzInfo->originY);
   /* Include the image using PGF's native image handling */
   printOutput(tikzInfo, "\t\\pgfimage[width=%6.2fpt,height=%6.2fpt,",
       width, height);
@@ -1545,7 +2430,7 @@ static void TikZ_Raster(
   printOutput(tikzInfo, "{%s}", translateChar(asChar(rasterFile)));
   printOutput(tikzInfo, "};\n");
 
-  if (tikzInfo->debug) { printOutput(tikzInfo, "\\draw[fill=red] (%6.2f, %6.2f) circle (1pt);", x, y); }
+  if (tikzInfo->debug) { printOutput(tikzInfo, "\\draw[fill=red] (%6.2f, %6.2f) circle (1pt);", x - tikzInfo->originX, y - tikzInfo->originY); }
 
   /*
    * Increment the number of raster files we have created with this device.
@@ -1644,9 +2529,18 @@ static void TikZ_DefineColors(pGEcontext plotParams, pDevDesc deviceInfo, TikZ_D
 
   tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
 
+  if ( tikzInfo->colorPalette ) {
+    if ( ops & DRAWOP_DRAW )
+      TikZ_PaletteColor(tikzInfo, plotParams->col, tikzInfo->drawColorName);
+    if ( ops & DRAWOP_FILL )
+      TikZ_PaletteColor(tikzInfo, plotParams->fill, tikzInfo->fillColorName);
+    return;
+  }
+
   if ( ops & DRAWOP_DRAW ) {
     color = plotParams->col;
     if ( color != tikzInfo->oldDrawColor ) {
+      TikZ_EndBatch(tikzInfo);
       tikzInfo->oldDrawColor = color;
       printOutput(tikzInfo,
         "\\definecolor[named]{drawColor}{rgb}{%4.2f,%4.2f,%4.2f}\n",
@@ -1659,6 +2553,7 @@ static void TikZ_DefineColors(pGEcontext plotParams, pDevDesc deviceInfo, TikZ_D
   if ( ops & DRAWOP_FILL ) {
     color = plotParams->fill;
     if( color != tikzInfo->oldFillColor ) {
+      TikZ_EndBatch(tikzInfo);
       tikzInfo->oldFillColor = color;
       printOutput(tikzInfo,
         "\\definecolor[named]{fillColor}{rgb}{%4.2f,%4.2f,%4.2f}\n",
@@ -1671,24 +2566,75 @@ static void TikZ_DefineColors(pGEcontext plotParams, pDevDesc deviceInfo, TikZ_D
 }
 
 /*
+ * Looks up the name of a color in the palette of the current page and copies
+ * it into `name`. A color seen for the first time is defined under a new
+ * name. The transparency of the color is not part of its name, it is written
+ * as an opacity option instead.
+ *
+ * The definition is made with \xglobal so that it survives the end of the
+ * scope of a clipping region. Paths that alternate between a few colors then
+ * only pay for each definition once.
+ */
+static void TikZ_PaletteColor(tikzDevDesc *tikzInfo, int color, char *name)
+{
+  unsigned char rgb[3];
+  TikZ_DictionaryEntry *entry;
+  Rboolean created;
+
+  rgb[0] = R_RED(color);
+  rgb[1] = R_GREEN(color);
+  rgb[2] = R_BLUE(color);
+
+  entry = TikZ_DictionaryInsert(&tikzInfo->palette, (const char *) rgb,
+    sizeof(rgb), &created);
+
+  if ( created ) {
+    /* Definitions may not appear in the middle of a path. */
+    TikZ_EndBatch(tikzInfo);
+    entry->value = ++tikzInfo->colorCount;
+    printOutput(tikzInfo,
+      "\\xglobal\\definecolor[named]{tikzdevColor%d}{rgb}{%4.2f,%4.2f,%4.2f}\n",
+      entry->value,
+      R_RED(color)/255.0,
+      R_GREEN(color)/255.0,
+      R_BLUE(color)/255.0);
+  }
+
+  sprintf(name, "tikzdevColor%d", entry->value);
+}
+
+/*
+ * Assembles the options for a path in the `style` buffer of the device. The
+ * options are not written to the output until `TikZ_StartPath` is called.
+ *
  * NOTE: This function operates under the assumption that no other functions
  * have written into the options bracket for a path. Custom path options should
- * be added after the call to `TikZ_WriteDrawOptions` and should remember to
- * bring their own commas.
+ * be added after the call to `TikZ_WriteDrawOptions` using `printStyle` and
+ * should remember to bring their own commas.
  */
 static void TikZ_WriteDrawOptions(const pGEcontext plotParams, pDevDesc deviceInfo,
     TikZ_DrawOps ops)
 {
+  tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
+
+  /* Start a fresh set of options. */
+  tikzInfo->style.length = 0;
+  TikZ_BufferReserve(&tikzInfo->style, 0);
+  tikzInfo->styleOps = ops;
+
   /* Bail out if there is nothing to do */
   if ( ops == DRAWOP_NOOP )
     return;
 
-  tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
+  if ( tikzInfo->pgfBasicLayer ) {
+    TikZ_WritePgfOptions(plotParams, tikzInfo, ops);
+    return;
+  }
 
   if ( ops & DRAWOP_DRAW ) {
-    printOutput(tikzInfo, "draw=drawColor");
+    printStyle(tikzInfo, "draw=%s", tikzInfo->drawColorName);
     if( !R_OPAQUE(plotParams->col) )
-      printOutput(tikzInfo, ",draw opacity=%4.2f", R_ALPHA(plotParams->col)/255.0);
+      printStyle(tikzInfo, ",draw opacity=%4.2f", R_ALPHA(plotParams->col)/255.0);
 
     TikZ_WriteLineStyle(plotParams, tikzInfo);
   }
@@ -1696,11 +2642,11 @@ static void TikZ_WriteDrawOptions(const pGEcontext plotParams, pDevDesc deviceIn
   if ( ops & DRAWOP_FILL ) {
     /* Toss in a comma if we printed draw options */
     if ( ops & DRAWOP_DRAW )
-      printOutput(tikzInfo, ",");
+      printStyle(tikzInfo, ",");
 
-    printOutput(tikzInfo, "fill=fillColor");
+    printStyle(tikzInfo, "fill=%s", tikzInfo->fillColorName);
     if( !R_OPAQUE(plotParams->fill) )
-      printOutput(tikzInfo, ",fill opacity=%4.2f", R_ALPHA(plotParams->fill)/255.0);
+      printStyle(tikzInfo, ",fill opacity=%4.2f", R_ALPHA(plotParams->fill)/255.0);
   }
 
 }
@@ -1712,7 +2658,7 @@ static void TikZ_WriteLineStyle(pGEcontext plotParams, tikzDevDesc *tikzInfo)
    * Set the line width, 0.4pt is the TikZ default so scale lwd=1 relative to
    * that
    */
-  printOutput(tikzInfo,",line width=%4.1fpt", 0.4*plotParams->lwd);
+  printStyle(tikzInfo,",line width=%4.1fpt", 0.4*plotParams->lwd);
 
   if ( plotParams->lty > 1 ) {
     char dashlist[8];
@@ -1746,14 +2692,14 @@ static void TikZ_WriteLineStyle(pGEcontext plotParams, tikzDevDesc *tikzInfo)
     }
     nlty = i; i = 0;
 
-    printOutput(tikzInfo, ",dash pattern=");
+    printStyle(tikzInfo, ",dash pattern=");
 
     /*Set the dash pattern*/
     while( i < nlty ){
       if( (i % 2) == 0 ){
-        printOutput(tikzInfo, "on %dpt ", dashlist[i]);
+        printStyle(tikzInfo, "on %dpt ", dashlist[i]);
       }else{
-        printOutput(tikzInfo, "off %dpt ", dashlist[i]);
+        printStyle(tikzInfo, "off %dpt ", dashlist[i]);
       }
       i++;
     }
@@ -1761,218 +2707,3517 @@ static void TikZ_WriteLineStyle(pGEcontext plotParams, tikzDevDesc *tikzInfo)
 
   switch ( plotParams->ljoin ) {
     case GE_ROUND_JOIN:
-      printOutput(tikzInfo, ",line join=round");
+      printStyle(tikzInfo, ",line join=round");
       break;
     case GE_MITRE_JOIN:
       /* Default if nothing is specified */
       if(plotParams->lmitre != 10)
-        printOutput(tikzInfo, ",mitre limit=%4.2f",plotParams->lmitre);
+        printStyle(tikzInfo, ",mitre limit=%4.2f",plotParams->lmitre);
       break;
     case GE_BEVEL_JOIN:
-      printOutput(tikzInfo, ",line join=bevel");
+      printStyle(tikzInfo, ",line join=bevel");
   }
 
   switch ( plotParams->lend ) {
     case GE_ROUND_CAP:
-      printOutput(tikzInfo, ",line cap=round");
+      printStyle(tikzInfo, ",line cap=round");
       break;
     case GE_BUTT_CAP:
       /* Default if nothing is specified */
       break;
     case GE_SQUARE_CAP:
-      printOutput(tikzInfo, ",line cap=rect");
+      printStyle(tikzInfo, ",line cap=rect");
   }
 
 }
 
 /*
- * This function calculates an appropriate scaling factor for text by
- * first calculating the ratio of the requested font size to the LaTeX
- * base font size. The ratio is then further scaled by the value of
- * the character expansion factor cex.
-*/
-static double
-ScaleFont( const pGEcontext plotParams, pDevDesc deviceInfo ){
+ * Assembles the same options as `TikZ_WriteDrawOptions` in the form of PGF
+ * basic layer commands, which take effect in the scope opened by
+ * `TikZ_StartPath`. Settings that match the PGF defaults are left out.
+ */
+static void TikZ_WritePgfOptions(const pGEcontext plotParams, tikzDevDesc *tikzInfo,
+    TikZ_DrawOps ops)
+{
+  if ( ops & DRAWOP_DRAW ) {
+    printStyle(tikzInfo, "\\pgfsetstrokecolor{%s}", tikzInfo->drawColorName);
+    if( !R_OPAQUE(plotParams->col) )
+      printStyle(tikzInfo, "\\pgfsetstrokeopacity{%4.2f}",
+        R_ALPHA(plotParams->col)/255.0);
 
-  // These parameters all affect the font size.
-  double baseSize = deviceInfo->startps;
-  double fontSize = plotParams->ps;
-  double cex = plotParams->cex;
+    printStyle(tikzInfo, "\\pgfsetlinewidth{%4.1fpt}", 0.4*plotParams->lwd);
 
-  double fontScale = ( fontSize / baseSize ) * cex;
+    /* See `TikZ_WriteLineStyle` for the encoding of the line type. */
+    if ( plotParams->lty > 1 ) {
+      int lty = plotParams->lty;
 
-  return( fontScale );
+      printStyle(tikzInfo, "\\pgfsetdash{");
+      while ( lty & 15 ) {
+        printStyle(tikzInfo, "{%dpt}", lty & 15);
+        lty = lty >> 4;
+      }
+      printStyle(tikzInfo, "}{0pt}");
+    }
 
-}
+    switch ( plotParams->ljoin ) {
+      case GE_ROUND_JOIN:
+        printStyle(tikzInfo, "\\pgfsetroundjoin");
+        break;
+      case GE_MITRE_JOIN:
+        if(plotParams->lmitre != 10)
+          printStyle(tikzInfo, "\\pgfsetmiterlimit{%4.2f}", plotParams->lmitre);
+        break;
+      case GE_BEVEL_JOIN:
+        printStyle(tikzInfo, "\\pgfsetbeveljoin");
+    }
 
+    switch ( plotParams->lend ) {
+      case GE_ROUND_CAP:
+        printStyle(tikzInfo, "\\pgfsetroundcap");
+        break;
+      case GE_BUTT_CAP:
+        break;
+      case GE_SQUARE_CAP:
+        printStyle(tikzInfo, "\\pgfsetrectcap");
+    }
+  }
 
-/*==============================================================================
+  if ( ops & DRAWOP_FILL ) {
+    printStyle(tikzInfo, "\\pgfsetfillcolor{%s}", tikzInfo->fillColorName);
+    if( !R_OPAQUE(plotParams->fill) )
+      printStyle(tikzInfo, "\\pgfsetfillopacity{%4.2f}",
+        R_ALPHA(plotParams->fill)/255.0);
+  }
 
-                         Other User Callable Routines
+}
 
-==============================================================================*/
+/*
+ * Begins a new path using the options assembled by `TikZ_WriteDrawOptions`
+ * and leaves the options bracket open.
+ *
+ * Plots tend to use the same few combinations of options over and over. The
+ * first time a combination is seen, it is written out in full. If it shows up
+ * again, it is given a name using \tikzset and from then on only the name is
+ * written. This makes the output smaller and saves TeX from having to parse
+ * the same key/value list for every path.
+ *
+ * For the PGF basic layer the path is opened as a pgfscope instead and named
+ * options become a macro. Since the name of a macro may not contain digits,
+ * it is defined and used through \csname.
+ */
+static void TikZ_StartPath(tikzDevDesc *tikzInfo)
+{
+  TikZ_DictionaryEntry *entry = NULL;
+  Rboolean created;
+
+  tikzInfo->pathOps = tikzInfo->styleOps;
+
+  if ( tikzInfo->styleDictionary && tikzInfo->style.length > 0 ) {
+    entry = TikZ_DictionaryInsert(&tikzInfo->styles,
+      tikzInfo->style.data, tikzInfo->style.length, &created);
+
+    if ( created ) {
+      /* First use. A value of 0 means the options have not been named yet. */
+      entry->value = 0;
+    } else if ( entry->value == 0 ) {
+      entry->value = ++tikzInfo->styleCount;
+      if ( tikzInfo->pgfBasicLayer )
+        printOutput(tikzInfo,
+          "\\expandafter\\def\\csname tikzdevStyle%d\\endcsname{%s}\n",
+          entry->value, tikzInfo->style.data);
+      else
+        printOutput(tikzInfo, "\\tikzset{tikzdevStyle%d/.style={%s}}\n",
+          entry->value, tikzInfo->style.data);
+    }
+  }
 
-void TikZ_Annotate(const char **annotation, int *size){
-  
-  //1. Get values of tikzInfo and deviceInfo
-  //2. Print out annotation 
-  pDevDesc deviceInfo = GEcurrentDevice()->dev;
-  
-  /* Shortcut pointers to variables of interest. */
-  tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
-    
-  int i = 0;
-    
-  if(tikzInfo->debug == TRUE)
-    printOutput(tikzInfo,"\n%% Annotating Graphic\n");
-  
-  for(i = 0; i < size[0]; ++i)
-    printOutput(tikzInfo, "%s\n", annotation[i] );
+  /* Remember where the path begins in case all of its shapes are hidden. */
+  tikzInfo->pathStart = tikzInfo->output.length;
+
+  if ( tikzInfo->pgfBasicLayer ) {
+    printOutput(tikzInfo, "\n\\begin{pgfscope}");
+    if ( entry != NULL && entry->value > 0 )
+      printOutput(tikzInfo, "\\csname tikzdevStyle%d\\endcsname", entry->value);
+    else
+      writeOutput(tikzInfo, tikzInfo->style.data, tikzInfo->style.length);
+  } else if ( entry != NULL && entry->value > 0 ) {
+    printOutput(tikzInfo, "\n\\path[tikzdevStyle%d", entry->value);
+  } else {
+    printOutput(tikzInfo, "\n\\path[");
+    writeOutput(tikzInfo, tikzInfo->style.data, tikzInfo->style.length);
+  }
 }
 
-
 /*
- * Returns information stored in the tikzDevDesc structure of a given device.
+ * Closes the options of a path begun by `TikZ_StartPath` and prints the
+ * `separator` that goes in front of its first shape. The commands of the PGF
+ * basic layer each start on a line of their own instead.
  */
-SEXP TikZ_DeviceInfo(SEXP device_num){
-
-  int dev_index = asInteger(device_num);
-  pDevDesc deviceInfo = GEgetDevice(dev_index - 1)->dev;
-  tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
+static void TikZ_EndOptions(tikzDevDesc *tikzInfo, const char *separator)
+{
+  if ( tikzInfo->pgfBasicLayer )
+    printOutput(tikzInfo, "\n\t");
+  else
+    printOutput(tikzInfo, "]%s", separator);
+}
 
-  SEXP info, names;
-  PROTECT( info = allocVector(VECSXP, 2) );
-  PROTECT( names = allocVector(STRSXP, 2) );
+/*
+ * Terminates the open path. For the PGF basic layer the path is filled and
+ * stroked as the options given to `TikZ_StartPath` ask for before its scope
+ * is closed.
+ */
+static void TikZ_EndPath(tikzDevDesc *tikzInfo)
+{
+  if ( !tikzInfo->pgfBasicLayer ) {
+    printOutput(tikzInfo, ";\n");
+    return;
+  }
 
-  SET_VECTOR_ELT(info, 0, mkString(tikzInfo->outFileName));
-  SET_STRING_ELT(names, 0, mkChar("output_file"));
+  if ( tikzInfo->luaPath ) {
+    tikzInfo->luaPath = FALSE;
+    printOutput(tikzInfo, "}}\n\t\\directlua{tikzdev.%s}\n\\end{pgfscope}\n",
+      tikzInfo->luaPaint);
+    return;
+  }
 
-  switch( tikzInfo->engine ){
-    case pdftex:
-      SET_VECTOR_ELT(info, 1, mkString("pdftex"));
+  switch ( tikzInfo->pathOps ) {
+    case DRAWOP_DRAW:
+      printOutput(tikzInfo, "\n\t\\pgfusepath{stroke}");
       break;
-    case xetex:
-      SET_VECTOR_ELT(info, 1, mkString("xetex"));
+    case DRAWOP_FILL:
+      printOutput(tikzInfo, "\n\t\\pgfusepath{fill}");
       break;
-    case luatex:
-      SET_VECTOR_ELT(info, 1, mkString("luatex"));
+    case DRAWOP_DRAW | DRAWOP_FILL:
+      printOutput(tikzInfo, "\n\t\\pgfusepath{fill,stroke}");
       break;
+    default:
+      printOutput(tikzInfo, "\n\t\\pgfusepath{}");
   }
-  SET_STRING_ELT(names, 1, mkChar("engine"));
+  printOutput(tikzInfo, "\n\\end{pgfscope}\n");
+}
 
+/*
+ * In the LuaTeX drawing mode, begins handing the values that describe the
+ * shapes of the path begun by `TikZ_StartPath` to Lua. `TikZ_EndPath` then
+ * paints them as circles or as subpaths, which are `closed` if they are the
+ * outlines of polygons. `evenOdd` selects the fill rule.
+ */
+static void TikZ_StartLua(tikzDevDesc *tikzInfo, Rboolean circles, Rboolean closed,
+    Rboolean evenOdd)
+{
+  int ops = tikzInfo->pathOps + (evenOdd ? 4 : 0);
 
-  setAttrib(info, R_NamesSymbol, names);
+  if ( circles )
+    sprintf(tikzInfo->luaPaint, "circles(%d)", ops);
+  else
+    sprintf(tikzInfo->luaPaint, "path(%d,%s)", ops, closed ? "true" : "false");
 
-  UNPROTECT(2);
-  return(info);
+  tikzInfo->luaPath = TRUE;
+  tikzInfo->luaValues = 0;
+  printOutput(tikzInfo, "\n\t\\directlua{tikzdev.data{");
+}
+
+/*
+ * Makes room for `count` more values in the Lua table being written and
+ * prints the comma that separates them from the values before. Once a table
+ * is full, the call is finished and a new one started.
+ */
+static void TikZ_LuaValues(tikzDevDesc *tikzInfo, int count)
+{
+  if ( tikzInfo->luaValues > 0 && tikzInfo->luaValues + count > TIKZ_LUA_CHUNK ) {
+    printOutput(tikzInfo, "}}\n\t\\directlua{tikzdev.data{");
+    tikzInfo->luaValues = 0;
+  } else if ( tikzInfo->luaValues > 0 ) {
+    printOutput(tikzInfo, ",\n");
+  }
 
+  tikzInfo->luaValues += count;
 }
 
+/*
+ * Decides whether a shape can be added to the path of the shape drawn before
+ * it. This is the case when both are of the same `kind`, use identical path
+ * options and, for plot marks, the same `mark`, and drawing them together in
+ * one path looks the same as drawing them one after the other. `left`,
+ * `bottom`, `right` and `top` give the bounding box of the new shape.
+ *
+ * TikZ fills every part of a path before stroking it and blends overlapping
+ * parts of a transparent path only once. Collecting shapes is therefore safe
+ * if they are painted with a single opaque color. Otherwise the new shape may
+ * only join the batch if it can not overlap any of the shapes already in it,
+ * which is checked against the combined bounding box of the batch.
+ *
+ * Returns TRUE if the shape should be appended to the open path. Otherwise
+ * any open batch is ended, the new shape becomes the start of the next one
+ * and the caller must begin a new path with `TikZ_StartPath`.
+ */
+static Rboolean TikZ_ContinueBatch(const pGEcontext plotParams, tikzDevDesc *tikzInfo,
+    TikZ_DrawOps ops, TikZ_BatchKind kind, int mark,
+    double left, double bottom, double right, double top){
 
-/* Run R evaluations inside a context protected from things like CTRL-C */
-SEXP TikZ_EvalWithoutInterrupts(SEXP expr, SEXP envir){
-  SEXP result;
+  Rboolean singleColor, tiled;
+  double padding;
 
-  BEGIN_SUSPEND_INTERRUPTS{
-    result = eval(expr, envir);
-  }END_SUSPEND_INTERRUPTS;
+  if ( !tikzInfo->batchPrimitives )
+    return FALSE;
 
-  return result;
-}
+  /*
+   * The bounding box of the batch is kept without the reach of its strokes,
+   * so the reach of both sides is applied to the new shape.
+   */
+  padding = 2 * TikZ_StrokeReach(plotParams, ops) + 1.0 / tikzInfo->coordScale;
+
+  if ( tikzInfo->batchKind == kind && tikzInfo->batchMark == mark &&
+      tikzInfo->batchStyle.length == tikzInfo->style.length &&
+      memcmp(tikzInfo->batchStyle.data, tikzInfo->style.data,
+        tikzInfo->style.length) == 0 ) {
+
+    switch ( ops ) {
+      case DRAWOP_DRAW:
+        singleColor = R_OPAQUE(plotParams->col);
+        break;
+      case DRAWOP_FILL:
+        singleColor = R_OPAQUE(plotParams->fill);
+        break;
+      default:
+        singleColor = R_OPAQUE(plotParams->col) &&
+          plotParams->col == plotParams->fill;
+    }
 
+    /*
+     * Rectangles that do not share any interior with the batch, like the bars
+     * of a histogram, may touch it. The part of an earlier outline that the
+     * new rectangle would paint over lies within half a line width of the new
+     * outline, so it is drawn over again anyway as long as that outline is
+     * solid and opaque.
+     */
+    tiled = kind == TIKZ_BATCH_RECTANGLE &&
+      ( !(ops & DRAWOP_DRAW) ||
+        (R_OPAQUE(plotParams->col) && plotParams->lty <= 1) ) &&
+      ( right <= tikzInfo->batchLeft || left >= tikzInfo->batchRight ||
+        top <= tikzInfo->batchBottom || bottom >= tikzInfo->batchTop );
+
+    if ( singleColor || tiled ||
+        right + padding < tikzInfo->batchLeft ||
+        left - padding > tikzInfo->batchRight ||
+        top + padding < tikzInfo->batchBottom ||
+        bottom - padding > tikzInfo->batchTop ) {
+      tikzInfo->batchLeft = fmin(tikzInfo->batchLeft, left);
+      tikzInfo->batchBottom = fmin(tikzInfo->batchBottom, bottom);
+      tikzInfo->batchRight = fmax(tikzInfo->batchRight, right);
+      tikzInfo->batchTop = fmax(tikzInfo->batchTop, top);
+      return TRUE;
+    }
 
-/*==============================================================================
+  }
 
-                               Utility Routines
+  /* Start a new batch with this shape. */
+  TikZ_EndBatch(tikzInfo);
+
+  tikzInfo->batchKind = kind;
+  tikzInfo->batchMark = mark;
+  tikzInfo->batchStyle.length = 0;
+  TikZ_BufferReserve(&tikzInfo->batchStyle, tikzInfo->style.length);
+  memcpy(tikzInfo->batchStyle.data, tikzInfo->style.data,
+    tikzInfo->style.length + 1);
+  tikzInfo->batchStyle.length = tikzInfo->style.length;
+  tikzInfo->batchLeft = left;
+  tikzInfo->batchBottom = bottom;
+  tikzInfo->batchRight = right;
+  tikzInfo->batchTop = top;
 
-==============================================================================*/
+  return FALSE;
 
-static void printOutput(tikzDevDesc *tikzInfo, const char *format, ...){
-  
-  va_list(ap);
-  va_start(ap, format);
-  
-  if(tikzInfo->console == TRUE)
-    Rvprintf(format, ap);
-  else
-    vfprintf(tikzInfo->outputFile, format, ap);
-  
-  va_end(ap);
-  
 }
 
-
 /*
- * This function is responsible for writing header information
- * to the output file. Currently this header information includes:
+ * Plot symbols such as triangles and diamonds arrive as small polygons that
+ * differ only in their position. The first time a shape is seen it is
+ * remembered by the offsets between its rounded vertices. When the same
+ * shape turns up again it is defined as a style that inserts the outline
+ * relative to the current point:
  *
- *   - The current version number of TikZ device.
- *   - The date on which the graphic was created.
+ *   \tikzset{tikzdevMark1/.style={insert path={--++(3,0)--++(-1.5,2.6)--cycle}}}
  *
-*/
-static void Print_TikZ_Header( tikzDevDesc *tikzInfo ){
+ * and every further copy is written as just its first vertex followed by the
+ * name of the mark. Copies drawn one after the other are batched like other
+ * shapes.
+ *
+ * Returns TRUE if the shape was written as a mark. Otherwise nothing has been
+ * written and the caller must write the shape in full.
+ */
+static Rboolean TikZ_WriteMark(const pGEcontext plotParams, tikzDevDesc *tikzInfo,
+    TikZ_DrawOps ops, int n, double *x, double *y, Rboolean closed){
+
+  double scaledX[TIKZ_MAX_MARK_VERTICES], scaledY[TIKZ_MAX_MARK_VERTICES];
+  long long key[2 * TIKZ_MAX_MARK_VERTICES];
+  double left, bottom, right, top;
+  char number[2 * TIKZ_NUMBER_LENGTH + 8];
+  TikZ_DictionaryEntry *entry;
+  Rboolean created;
+  int i, length;
+
+  if ( !tikzInfo->plotMarks || n < 3 || n > TIKZ_MAX_MARK_VERTICES )
+    return FALSE;
 
-  /* Call back to R to retrieve current date and version num*/
+  scaleVertices(tikzInfo, n, x, y, scaledX, scaledY);
 
-  /*
-   * Recover package namespace as the date formatting function
-   * is not exported
-  */
-  SEXP namespace;
-  PROTECT( namespace = TIKZ_NAMESPACE );
+  key[0] = closed;
+  for ( i = 1; i < n; i++ ) {
+    key[2 * i - 1] = (long long) (scaledX[i] - scaledX[i - 1]);
+    key[2 * i] = (long long) (scaledY[i] - scaledY[i - 1]);
+  }
 
+  entry = TikZ_DictionaryInsert(&tikzInfo->marks, (const char *) key,
+    (2 * n - 1) * sizeof(long long), &created);
 
-  SEXP currentDate;
-  PROTECT(
-    currentDate = eval(lang1( install("getDateStampForTikz") ),
-      namespace )
-  );
+  if ( created ) {
+    /* First sighting. Remember the shape but write it out normally. */
+    entry->value = 0;
+    return FALSE;
+  }
 
-  SEXP currentVersion;
-  PROTECT(
-    currentVersion = eval(lang1( install("getTikzDeviceVersion") ),
-      namespace )
-  );
+  if ( entry->value == 0 ) {
+    TikZ_EndBatch(tikzInfo);
+    entry->value = ++tikzInfo->markCount;
+
+    printOutput(tikzInfo, "\\tikzset{tikzdevMark%d/.style={insert path={",
+      entry->value);
+    for ( i = 1; i < n; i++ ) {
+      length = sprintf(number, "--++(");
+      length += formatFixed(number + length, key[2 * i - 1],
+        tikzInfo->coordPrecision, tikzInfo->trimZeros);
+      number[length++] = ',';
+      length += formatFixed(number + length, key[2 * i],
+        tikzInfo->coordPrecision, tikzInfo->trimZeros);
+      number[length++] = ')';
+      writeOutput(tikzInfo, number, length);
+    }
+    printOutput(tikzInfo, "%s}}}\n", closed ? "--cycle" : "");
+  }
 
-  printOutput( tikzInfo, "%% Created by tikzDevice version %s on %s\n",
-    CHAR(STRING_ELT(currentVersion,0)), CHAR(STRING_ELT(currentDate,0)) );
+  left = right = x[0];
+  bottom = top = y[0];
+  for ( i = 1; i < n; i++ ) {
+    left = fmin(left, x[i]);
+    right = fmax(right, x[i]);
+    bottom = fmin(bottom, y[i]);
+    top = fmax(top, y[i]);
+  }
 
-	//Specifically for TeXShop, force it to open the file with UTF-8 encoding
-	printOutput(tikzInfo, "%% !TEX encoding = UTF-8 Unicode\n");
+  if ( TikZ_ContinueBatch(plotParams, tikzInfo, ops, TIKZ_BATCH_MARK,
+      entry->value, left, bottom, right, top) ) {
+    TikZ_ShapeStart(tikzInfo);
+    printOutput(tikzInfo, "\n\t");
+  } else {
+    TikZ_StartPath(tikzInfo);
+    TikZ_EndOptions(tikzInfo, " ");
+    TikZ_ShapeStart(tikzInfo);
+  }
 
-  UNPROTECT(3);
+  printCoordinate(tikzInfo, x[0], y[0]);
+  printOutput(tikzInfo, " [tikzdevMark%d]", entry->value);
+  TikZ_ShapeEnd(tikzInfo);
+  TikZ_FinishShape(tikzInfo);
+
+  return TRUE;
 
 }
 
-static char *Sanitize(const char *str){
+/*
+ * Called once a shape that may be batched has been written. The path is left
+ * open for the next shape only if batching is turned on.
+ */
+static void TikZ_FinishShape(tikzDevDesc *tikzInfo){
 
-  
-  //Splice in escaped charaters via a callback to R
-  
-  //Call out to R to retrieve the sanitizeTexString function.
-  SEXP sanitizeFun = findFun( install("sanitizeTexString"), R_GlobalEnv );
+  if ( !tikzInfo->batchPrimitives )
+    TikZ_EndPath(tikzInfo);
 
-  /*
-   * Create a SEXP that will be the R function call. The SEXP will
-   * have four components- the R function being calledand the string 
-   * being passed. Therefore it is allocated as a  LANGSXP
-   * vector of length 2. This is done inside a PROTECT() function
-   * to keep the R garbage collector from saying "Hmmm... what's
-   * this? Looks like noone is using it so I guess I will nuke it."
-  */
-  SEXP RCallBack;
-  PROTECT( RCallBack = allocVector(LANGSXP,2) );
+}
 
-  // Place the function into the first slot of the SEXP.
-  SETCAR( RCallBack, sanitizeFun );
-  
-  // Place the string into the second slot of the SEXP.
-  SETCADR( RCallBack, mkString( str ) );
-  // Tag the string with a name, this name coressponds to the
-  // dummy argument of the R function sanitizeTexString.
-  SET_TAG( CDR( RCallBack ), install("string") );
+/*
+ * Terminates the open path of a batch of shapes. Must be called before
+ * anything other than another shape of the batch is written.
+ */
+static void TikZ_EndBatch(tikzDevDesc *tikzInfo){
 
-  /*
+  if ( tikzInfo->batchKind == TIKZ_BATCH_NONE )
+    return;
+
+  tikzInfo->batchKind = TIKZ_BATCH_NONE;
+  TikZ_EndPath(tikzInfo);
+
+}
+
+/*
+ * Strokes reach past the outline of a shape by half the line width, or
+ * further at mitred corners. Returns a generous estimate of this distance,
+ * which errs on the side of caution.
+ */
+static double TikZ_StrokeReach(const pGEcontext plotParams, TikZ_DrawOps ops){
+
+  double reach = 0;
+
+  if ( ops & DRAWOP_DRAW ) {
+    reach = 0.4 * plotParams->lwd;
+    if ( plotParams->ljoin == GE_MITRE_JOIN )
+      reach *= fmax(plotParams->lmitre, 1.0);
+  }
+
+  return reach;
+
+}
+
+/*
+ * Finds the part of the page in which a shape drawn with the given options can
+ * leave a visible mark: the clipping region grown by the reach of the stroke
+ * and one point to spare. Pieces of a shape outside of this region may be
+ * dropped, and vertices moved onto its edge, without changing the picture.
+ * The region is stored as left, bottom, right and top in `region`.
+ *
+ * Returns FALSE if shapes should always be written in full.
+ */
+static Rboolean TikZ_VisibleRegion(const pGEcontext plotParams, pDevDesc deviceInfo,
+    TikZ_DrawOps ops, double *region){
+
+  tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
+  double margin = TikZ_StrokeReach(plotParams, ops) + 1.0;
+
+  if ( !tikzInfo->clipPrimitives )
+    return FALSE;
+
+  region[0] = fmin(deviceInfo->clipLeft, deviceInfo->clipRight) - margin;
+  region[1] = fmin(deviceInfo->clipBottom, deviceInfo->clipTop) - margin;
+  region[2] = fmax(deviceInfo->clipLeft, deviceInfo->clipRight) + margin;
+  region[3] = fmax(deviceInfo->clipBottom, deviceInfo->clipTop) + margin;
+
+  return TRUE;
+
+}
+
+/*
+ * Returns TRUE if a shape with the given bounding box can not be seen
+ * because it lies entirely outside of the clipping region.
+ */
+static Rboolean TikZ_Culled(const pGEcontext plotParams, pDevDesc deviceInfo,
+    TikZ_DrawOps ops, double left, double bottom, double right, double top){
+
+  double region[4];
+
+  return TikZ_VisibleRegion(plotParams, deviceInfo, ops, region) &&
+    ( right < region[0] || left > region[2] ||
+      top < region[1] || bottom > region[3] );
+
+}
+
+/*
+ * Compares the bounding box of a set of vertices with `region`. A shape
+ * reported as crossing the edge of the region may still miss it entirely,
+ * like a line running around one of its corners.
+ */
+static TikZ_OverlapKind TikZ_Overlap(const double *region, int n, double *x, double *y){
+
+  double left, bottom, right, top;
+  int i;
+
+  if ( n <= 0 )
+    return TIKZ_OUTSIDE;
+
+  left = right = x[0];
+  bottom = top = y[0];
+  for ( i = 1; i < n; i++ ) {
+    left = fmin(left, x[i]);
+    right = fmax(right, x[i]);
+    bottom = fmin(bottom, y[i]);
+    top = fmax(top, y[i]);
+  }
+
+  if ( right < region[0] || left > region[2] ||
+      top < region[1] || bottom > region[3] )
+    return TIKZ_OUTSIDE;
+
+  if ( left >= region[0] && right <= region[2] &&
+      bottom >= region[1] && top <= region[3] )
+    return TIKZ_INSIDE;
+
+  return TIKZ_CROSSING;
+
+}
+
+/*
+ * Occlusion culling. When enabled, every opaque circle, rectangle and polygon
+ * written to a page is recorded along with the position of its text in the
+ * output buffer, which is held back until the page is finished. Shapes with
+ * an opaque fill also act as occluders: they hide whatever lies beneath
+ * them. When the page ends `TikZ_CullOccluded` removes the text of shapes
+ * that are completely covered by occluders drawn after them.
+ *
+ * Shapes that are translucent in any way are never recorded, so they are
+ * neither removed nor used to hide others.
+ */
+
+/*
+ * Records a shape that is about to be written with the bounding box of its
+ * outline. Returns NULL if occlusion culling is off or the shape is not
+ * opaque. Otherwise the caller may fill in the occluder of the returned
+ * record, which is only valid until the next shape is recorded, and must
+ * mark the extent of the text of the shape with `TikZ_ShapeStart` and
+ * `TikZ_ShapeEnd`.
+ */
+static TikZ_Shape *TikZ_RecordShape(const pGEcontext plotParams, pDevDesc deviceInfo,
+    TikZ_DrawOps ops, double left, double bottom, double right, double top){
+
+  tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
+  TikZ_Shape *shape;
+  double reach;
+
+  tikzInfo->currentShape = -1;
+
+  if ( !tikzInfo->occlusionCulling || ops == DRAWOP_NOOP ||
+      ((ops & DRAWOP_DRAW) && !R_OPAQUE(plotParams->col)) ||
+      ((ops & DRAWOP_FILL) && !R_OPAQUE(plotParams->fill)) )
+    return NULL;
+
+  if ( tikzInfo->shapeCount == tikzInfo->shapeCapacity ) {
+    int capacity = tikzInfo->shapeCapacity > 0 ? 2 * tikzInfo->shapeCapacity : 1024;
+    shape = (TikZ_Shape *) realloc(tikzInfo->shapes, capacity * sizeof(TikZ_Shape));
+    if ( shape == NULL )
+      error("The tikzDevice was unable to allocate memory for shapes.");
+    tikzInfo->shapes = shape;
+    tikzInfo->shapeCapacity = capacity;
+  }
+
+  /*
+   * The stroke and the rounding of the written coordinates can make a shape
+   * a little larger than its outline.
+   */
+  reach = TikZ_StrokeReach(plotParams, ops) + 3.0 / tikzInfo->coordScale;
+
+  tikzInfo->currentShape = tikzInfo->shapeCount++;
+  shape = tikzInfo->shapes + tikzInfo->currentShape;
+  shape->pathStart = shape->start = shape->end = tikzInfo->output.length;
+  shape->left = left - reach;
+  shape->bottom = bottom - reach;
+  shape->right = right + reach;
+  shape->top = top + reach;
+  shape->circle = FALSE;
+  shape->occluder = TIKZ_OCCLUDER_NONE;
+  shape->clipLeft = fmin(deviceInfo->clipLeft, deviceInfo->clipRight);
+  shape->clipBottom = fmin(deviceInfo->clipBottom, deviceInfo->clipTop);
+  shape->clipRight = fmax(deviceInfo->clipLeft, deviceInfo->clipRight);
+  shape->clipTop = fmax(deviceInfo->clipBottom, deviceInfo->clipTop);
+  shape->hidden = FALSE;
+
+  return shape;
+
+}
+
+/* Records a polygon that is about to be written. */
+static void TikZ_RecordPolygon(const pGEcontext plotParams, pDevDesc deviceInfo,
+    TikZ_DrawOps ops, int n, double *x, double *y){
+
+  tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
+  double left, bottom, right, top;
+  TikZ_Shape *shape;
+  int i;
+
+  tikzInfo->currentShape = -1;
+  if ( !tikzInfo->occlusionCulling || n < 1 )
+    return;
+
+  left = right = x[0];
+  bottom = top = y[0];
+  for ( i = 1; i < n; i++ ) {
+    left = fmin(left, x[i]);
+    right = fmax(right, x[i]);
+    bottom = fmin(bottom, y[i]);
+    top = fmax(top, y[i]);
+  }
+
+  shape = TikZ_RecordShape(plotParams, deviceInfo, ops, left, bottom, right, top);
+  if ( shape != NULL && (ops & DRAWOP_FILL) )
+    TikZ_SetPolygonOccluder(tikzInfo, shape, n, x, y);
+
+}
+
+/*
+ * Makes a filled polygon hide the shapes beneath it. Only convex polygons,
+ * such as the squares, diamonds and triangles used as plot symbols, are used
+ * because for them a point lies inside if it lies on the inner side of every
+ * edge. Their vertices are stored in counterclockwise order.
+ */
+static void TikZ_SetPolygonOccluder(tikzDevDesc *tikzInfo, TikZ_Shape *shape,
+    int n, double *x, double *y){
+
+  double cross, dot, turning = 0, direction = 0, *vertices;
+  int i, a, b;
+
+  if ( n < 3 )
+    return;
+
+  /*
+   * Every corner must turn the same way and the turns must add up to a
+   * single revolution. The second test rules out stars.
+   */
+  for ( i = 0; i < n; i++ ) {
+    a = (i + 1) % n;
+    b = (i + 2) % n;
+    cross = (x[a] - x[i]) * (y[b] - y[a]) - (y[a] - y[i]) * (x[b] - x[a]);
+    dot = (x[a] - x[i]) * (x[b] - x[a]) + (y[a] - y[i]) * (y[b] - y[a]);
+
+    if ( cross != 0 ) {
+      if ( direction == 0 )
+        direction = cross > 0 ? 1 : -1;
+      else if ( (cross > 0 ? 1 : -1) != direction )
+        return;
+    }
+    turning += atan2(cross, dot);
+  }
+
+  if ( direction == 0 || fabs(turning) > 2 * M_PI + 1e-6 )
+    return;
+
+  if ( tikzInfo->shapeVertexCount + n > tikzInfo->shapeVertexCapacity ) {
+    int capacity = tikzInfo->shapeVertexCapacity > 0 ?
+      tikzInfo->shapeVertexCapacity : 1024;
+    while ( capacity < tikzInfo->shapeVertexCount + n )
+      capacity *= 2;
+
+    vertices = (double *) realloc(tikzInfo->shapeVertices,
+      2 * capacity * sizeof(double));
+    if ( vertices == NULL )
+      return;
+    tikzInfo->shapeVertices = vertices;
+    tikzInfo->shapeVertexCapacity = capacity;
+  }
+
+  vertices = tikzInfo->shapeVertices + 2 * tikzInfo->shapeVertexCount;
+  for ( i = 0; i < n; i++ ) {
+    a = direction > 0 ? i : n - 1 - i;
+    vertices[2 * i] = x[a];
+    vertices[2 * i + 1] = y[a];
+  }
+
+  shape->occluder = TIKZ_OCCLUDER_POLYGON;
+  shape->vertexOffset = tikzInfo->shapeVertexCount;
+  shape->vertexCount = n;
+  tikzInfo->shapeVertexCount += n;
+
+}
+
+/*
+ * Mark the beginning and the end of the text of the shape recorded last.
+ * A shape added to an open path starts with the whitespace that separates it
+ * from the shape before it.
+ */
+static void TikZ_ShapeStart(tikzDevDesc *tikzInfo){
+
+  if ( tikzInfo->currentShape < 0 )
+    return;
+
+  tikzInfo->shapes[tikzInfo->currentShape].pathStart = tikzInfo->pathStart;
+  tikzInfo->shapes[tikzInfo->currentShape].start = tikzInfo->output.length;
+
+}
+
+static void TikZ_ShapeEnd(tikzDevDesc *tikzInfo){
+
+  if ( tikzInfo->currentShape < 0 )
+    return;
+
+  tikzInfo->shapes[tikzInfo->currentShape].end = tikzInfo->output.length;
+  tikzInfo->currentShape = -1;
+
+}
+
+/*
+ * Removes the shapes recorded on the current page that are hidden by
+ * occluders drawn after them, then forgets all recorded shapes so that the
+ * output may be written again.
+ *
+ * The page is covered by a grid of small cells. Going from the last shape to
+ * the first, a shape is hidden if every cell it touches has been covered.
+ * Each visible occluder then covers the cells that lie completely inside it
+ * and inside its clipping region. Since cells are only covered when they are
+ * certainly hidden, the result errs on the side of keeping shapes.
+ *
+ * The grid can not tell that a shape is hidden by an exact copy of itself,
+ * as happens when several points of a data set coincide. Occluders are also
+ * remembered by the text of their path options, the shape itself and their
+ * clipping region, and an earlier shape that matches one of them is hidden.
+ *
+ * If every shape of a \path is hidden, the whole command is removed.
+ */
+static void TikZ_CullOccluded(pDevDesc deviceInfo){
+
+  tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
+  TikZ_Shape *shapes = tikzInfo->shapes;
+  int count = tikzInfo->shapeCount;
+  double width = deviceInfo->right, height = deviceInfo->top, cell;
+  int columns, rows, i, k, last;
+  unsigned char *mask;
+  char *data = tikzInfo->output.data;
+  size_t read = 0, write = 0;
+  Rboolean wholePath, leading, created, keyed;
+  TikZ_Dictionary copies = { NULL, 0, 0 };
+  TikZ_DictionaryEntry *entry;
+  TikZ_Buffer key = { NULL, 0, 0 };
+
+  tikzInfo->shapeCount = 0;
+  tikzInfo->shapeVertexCount = 0;
+  tikzInfo->currentShape = -1;
+
+  if ( count == 0 )
+    return;
+
+  cell = fmax(TIKZ_COVERAGE_CELL_SIZE, fmax(width, height) / TIKZ_COVERAGE_CELLS);
+  columns = (int) ceil(width / cell);
+  rows = (int) ceil(height / cell);
+  if ( columns < 1 || rows < 1 )
+    return;
+
+  /* Without memory to spare, the page is simply written in full. */
+  mask = (unsigned char *) calloc((size_t) columns * rows, 1);
+  if ( mask == NULL )
+    return;
+
+  for ( i = count - 1; i >= 0; i-- ) {
+    shapes[i].hidden = shapeCovered(mask, columns, rows, cell, shapes + i);
+    if ( shapes[i].hidden )
+      continue;
+
+    /* A value of 1 marks the copies that are occluders. */
+    keyed = TikZ_ShapeKey(tikzInfo, shapes + i, &key);
+    if ( keyed ) {
+      entry = TikZ_DictionaryInsert(&copies, key.data, key.length, &created);
+      if ( created )
+        entry->value = 0;
+      if ( entry->value == 1 ) {
+        shapes[i].hidden = TRUE;
+        continue;
+      }
+    }
+
+    if ( shapes[i].occluder != TIKZ_OCCLUDER_NONE ) {
+      coverOccluder(mask, columns, rows, cell, shapes + i,
+        tikzInfo->shapeVertices, 1.0 / tikzInfo->coordScale);
+      if ( keyed )
+        entry->value = 1;
+    }
+  }
+
+  free(mask);
+  free(key.data);
+  TikZ_DictionaryClear(&copies);
+  free(copies.entries);
+
+  /*
+   * Cut the hidden shapes out of the buffer, moving the text that is kept
+   * towards its beginning. Shapes that share a path are handled together.
+   * The path is removed along with them if they are all hidden and nothing
+   * else is part of it.
+   */
+  for ( i = 0; i < count; i = last + 1 ) {
+    wholePath = shapes[i].hidden && shapes[i].pathStart < shapes[i].start &&
+      shapes[i].start - shapes[i].pathStart >= 9 &&
+      strncmp(data + shapes[i].pathStart, "\n\\path[", 7) == 0 &&
+      strncmp(data + shapes[i].start - 2, "] ", 2) == 0;
+
+    for ( last = i; last + 1 < count &&
+        shapes[last + 1].pathStart == shapes[i].pathStart; last++ )
+      wholePath = wholePath && shapes[last + 1].hidden &&
+        shapes[last + 1].start == shapes[last].end;
+
+    wholePath = wholePath &&
+      tikzInfo->output.length - shapes[last].end >= 2 &&
+      strncmp(data + shapes[last].end, ";\n", 2) == 0;
+
+    if ( wholePath ) {
+      cutText(data, &read, &write, shapes[i].pathStart, shapes[last].end + 2);
+      continue;
+    }
+
+    /*
+     * When the first shapes of a path are hidden, the one that takes their
+     * place loses the whitespace that separated it from them.
+     */
+    leading = shapes[i].start >= 2 &&
+      strncmp(data + shapes[i].start - 2, "] ", 2) == 0;
+    for ( k = i; k <= last; k++ ) {
+      leading = leading && (k == i || shapes[k].start == shapes[k - 1].end);
+      if ( shapes[k].hidden ) {
+        cutText(data, &read, &write, shapes[k].start, shapes[k].end);
+      } else {
+        if ( leading && k > i &&
+            strncmp(data + shapes[k].start, "\n\t", 2) == 0 )
+          cutText(data, &read, &write, shapes[k].start, shapes[k].start + 2);
+        leading = FALSE;
+      }
+    }
+  }
+
+  cutText(data, &read, &write, tikzInfo->output.length, tikzInfo->output.length);
+  tikzInfo->output.length = write;
+  data[write] = '\0';
+
+}
+
+/*
+ * Fills `key` with the options of the path a shape belongs to, the text of
+ * the shape and its clipping region. Two shapes with the same key paint
+ * exactly the same area. Returns FALSE if the options can not be found.
+ */
+static Rboolean TikZ_ShapeKey(tikzDevDesc *tikzInfo, const TikZ_Shape *shape,
+    TikZ_Buffer *key){
+
+  const char *data = tikzInfo->output.data, *options, *text;
+  const char *optionsEnd;
+  double clip[4];
+
+  if ( shape->pathStart >= shape->start ||
+      strncmp(data + shape->pathStart, "\n\\path[", 7) != 0 )
+    return FALSE;
+
+  options = data + shape->pathStart + 7;
+  optionsEnd = memchr(options, ']', data + shape->start - options);
+  if ( optionsEnd == NULL )
+    return FALSE;
+
+  /* Skip the whitespace that separates the shape from the one before it. */
+  text = data + shape->start;
+  while ( text < data + shape->end &&
+      (*text == '\n' || *text == '\t' || *text == ' ') )
+    text++;
+
+  clip[0] = shape->clipLeft;
+  clip[1] = shape->clipBottom;
+  clip[2] = shape->clipRight;
+  clip[3] = shape->clipTop;
+
+  key->length = 0;
+  TikZ_BufferReserve(key, sizeof(clip) + (optionsEnd - options) + 1 +
+    (data + shape->end - text));
+  memcpy(key->data, clip, sizeof(clip));
+  key->length = sizeof(clip);
+  memcpy(key->data + key->length, options, optionsEnd - options + 1);
+  key->length += optionsEnd - options + 1;
+  memcpy(key->data + key->length, text, data + shape->end - text);
+  key->length += data + shape->end - text;
+
+  return TRUE;
+
+}
+
+/*
+ * Removes the text between `from` and `to` from a buffer that is being
+ * compacted. Text before `read` has been dealt with and the text kept so far
+ * ends at `write`.
+ */
+static void cutText(char *data, size_t *read, size_t *write, size_t from, size_t to){
+
+  memmove(data + *write, data + *read, from - *read);
+  *write += from - *read;
+  *read = to;
+
+}
+
+/*
+ * Covers the cells of the grid that lie completely inside an occluder and
+ * inside its clipping region shrunk by `margin`.
+ */
+static void coverOccluder(unsigned char *mask, int columns, int rows, double cell,
+    const TikZ_Shape *shape, const double *vertices, double margin){
+
+  double left, bottom, right, top, cornerX[4], cornerY[4], dx, dy;
+  int i, j, k, first, last, lowest, highest;
+  Rboolean inside;
+
+  if ( shape->occluder == TIKZ_OCCLUDER_CIRCLE ) {
+    left = shape->x - shape->inner;
+    right = shape->x + shape->inner;
+    bottom = shape->y - shape->inner;
+    top = shape->y + shape->inner;
+  } else {
+    vertices += 2 * shape->vertexOffset;
+    left = right = vertices[0];
+    bottom = top = vertices[1];
+    for ( k = 1; k < shape->vertexCount; k++ ) {
+      left = fmin(left, vertices[2 * k]);
+      right = fmax(right, vertices[2 * k]);
+      bottom = fmin(bottom, vertices[2 * k + 1]);
+      top = fmax(top, vertices[2 * k + 1]);
+    }
+  }
+
+  left = fmax(left, shape->clipLeft + margin);
+  right = fmin(right, shape->clipRight - margin);
+  bottom = fmax(bottom, shape->clipBottom + margin);
+  top = fmin(top, shape->clipTop - margin);
+
+  /* Only cells that fit between the edges of the bounding box qualify. */
+  first = (int) fmax(0, ceil(left / cell));
+  last = (int) fmin(columns, floor(right / cell)) - 1;
+  lowest = (int) fmax(0, ceil(bottom / cell));
+  highest = (int) fmin(rows, floor(top / cell)) - 1;
+
+  for ( j = lowest; j <= highest; j++ ) {
+    for ( i = first; i <= last; i++ ) {
+      cornerX[0] = cornerX[3] = i * cell;
+      cornerX[1] = cornerX[2] = (i + 1) * cell;
+      cornerY[0] = cornerY[1] = j * cell;
+      cornerY[2] = cornerY[3] = (j + 1) * cell;
+
+      /* Both kinds of occluder are convex, so checking the corners is enough. */
+      inside = TRUE;
+      for ( k = 0; k < 4 && inside; k++ ) {
+        if ( shape->occluder == TIKZ_OCCLUDER_CIRCLE ) {
+          dx = cornerX[k] - shape->x;
+          dy = cornerY[k] - shape->y;
+          inside = dx * dx + dy * dy <= shape->inner * shape->inner;
+        } else {
+          inside = insideConvex(shape->vertexCount, vertices,
+            cornerX[k], cornerY[k]);
+        }
+      }
+
+      if ( inside )
+        mask[(size_t) j * columns + i] = 1;
+    }
+  }
+
+}
+
+/*
+ * Returns TRUE if every cell touched by a shape has been covered. For
+ * circles these are the cells that reach into the circle, for other shapes
+ * those touched by the bounding box. Shapes that reach beyond the page are
+ * never considered hidden.
+ */
+static Rboolean shapeCovered(const unsigned char *mask, int columns, int rows,
+    double cell, const TikZ_Shape *shape){
+
+  int i, j, first, last, lowest, highest;
+  double dx, dy;
+
+  if ( !(shape->left >= 0 && shape->bottom >= 0 &&
+      shape->right < columns * cell && shape->top < rows * cell) )
+    return FALSE;
+
+  first = (int) floor(shape->left / cell);
+  last = (int) floor(shape->right / cell);
+  lowest = (int) floor(shape->bottom / cell);
+  highest = (int) floor(shape->top / cell);
+
+  for ( j = lowest; j <= highest; j++ ) {
+    for ( i = first; i <= last; i++ ) {
+      if ( mask[(size_t) j * columns + i] )
+        continue;
+
+      if ( !shape->circle )
+        return FALSE;
+
+      /* Find the point of the cell closest to the center of the circle. */
+      dx = fmax(fmax(i * cell - shape->x, shape->x - (i + 1) * cell), 0);
+      dy = fmax(fmax(j * cell - shape->y, shape->y - (j + 1) * cell), 0);
+      if ( dx * dx + dy * dy <= shape->r * shape->r )
+        return FALSE;
+    }
+  }
+
+  return TRUE;
+
+}
+
+/*
+ * Returns TRUE if a point lies inside, or on the edge of, a convex polygon
+ * with vertices stored as x, y pairs in counterclockwise order.
+ */
+static Rboolean insideConvex(int n, const double *vertices, double px, double py){
+
+  int i, j;
+
+  for ( i = 0, j = n - 1; i < n; j = i++ ) {
+    if ( (vertices[2 * i] - vertices[2 * j]) * (py - vertices[2 * j + 1]) -
+        (vertices[2 * i + 1] - vertices[2 * j + 1]) * (px - vertices[2 * j]) < 0 )
+      return FALSE;
+  }
+
+  return TRUE;
+
+}
+
+/*
+ * Counts primitives drawn inside the current clipping region against the
+ * raster budget. Once the budget is used up, returns TRUE and makes sure a
+ * canvas covering the clipping region is ready so that the caller can paint
+ * the primitive on it instead of writing it to the output.
+ *
+ * Only the primitives that make up dense layers of points and segments are
+ * counted: circles, line segments and the rectangles and small polygons of
+ * plot symbols. Everything else is written as usual after the canvas has
+ * been flushed.
+ */
+static Rboolean TikZ_Rasterize(pDevDesc deviceInfo, int primitives){
+
+  tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
+  TikZ_Canvas *canvas = &tikzInfo->canvas;
+  double left, bottom, right, top, scale;
+
+  if ( tikzInfo->rasterBudget == 0 )
+    return FALSE;
+
+  if ( primitives <= tikzInfo->rasterBudget - tikzInfo->regionPrimitives ) {
+    tikzInfo->regionPrimitives += primitives;
+    return FALSE;
+  }
+  tikzInfo->regionPrimitives = tikzInfo->rasterBudget;
+
+  if ( canvas->pixels != NULL )
+    return TRUE;
+
+  left = fmin(deviceInfo->clipLeft, deviceInfo->clipRight);
+  right = fmax(deviceInfo->clipLeft, deviceInfo->clipRight);
+  bottom = fmin(deviceInfo->clipBottom, deviceInfo->clipTop);
+  top = fmax(deviceInfo->clipBottom, deviceInfo->clipTop);
+
+  scale = tikzInfo->rasterResolution / dim2dev(1.0);
+  if ( (right - left) * (top - bottom) * scale * scale > TIKZ_MAX_CANVAS_PIXELS )
+    scale = sqrt(TIKZ_MAX_CANVAS_PIXELS / ((right - left) * (top - bottom)));
+
+  canvas->left = left;
+  canvas->top = top;
+  canvas->scale = scale;
+  canvas->columns = (int) fmax(ceil((right - left) * scale), 1);
+  canvas->rows = (int) fmax(ceil((top - bottom) * scale), 1);
+  canvas->pixels = (unsigned char *) calloc(
+    (size_t) canvas->columns * canvas->rows, 4);
+  if ( canvas->pixels == NULL )
+    error("The tikzDevice was unable to allocate memory for a raster image.");
+
+  return TRUE;
+
+}
+
+/*
+ * Returns TRUE if a shape with the given bounding box is no larger than a
+ * character of the current font, the size at which R draws plot symbols.
+ */
+static Rboolean TikZ_SymbolSized(const pGEcontext plotParams,
+    double left, double bottom, double right, double top){
+
+  double size = plotParams->cex * plotParams->ps;
+
+  return right - left <= size && top - bottom <= size;
+
+}
+
+/*
+ * Writes whatever has been painted on the canvas as an image, using the same
+ * route as rasters drawn by R, and leaves the canvas empty.
+ */
+static void TikZ_FlushCanvas(pDevDesc deviceInfo){
+
+  tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
+  TikZ_Canvas *canvas = &tikzInfo->canvas;
+  unsigned char *pixels = canvas->pixels, *pixel;
+  unsigned int *raster;
+  size_t i, count;
+  int alpha;
+
+  if ( pixels == NULL )
+    return;
+  canvas->pixels = NULL;
+
+  count = (size_t) canvas->columns * canvas->rows;
+  raster = (unsigned int *) malloc(count * sizeof(unsigned int));
+  if ( raster == NULL ) {
+    free(pixels);
+    error("The tikzDevice was unable to allocate memory for a raster image.");
+  }
+
+  /* Undo the premultiplication of the color values by alpha. */
+  for ( i = 0, pixel = pixels; i < count; i++, pixel += 4 ) {
+    alpha = pixel[3];
+    if ( alpha == 0 )
+      raster[i] = R_RGBA(0, 0, 0, 0);
+    else
+      raster[i] = R_RGBA(
+        (pixel[0] * 255 + alpha / 2) / alpha,
+        (pixel[1] * 255 + alpha / 2) / alpha,
+        (pixel[2] * 255 + alpha / 2) / alpha,
+        alpha);
+  }
+  free(pixels);
+
+  TikZ_Raster(raster, canvas->columns, canvas->rows,
+    canvas->left, canvas->top - canvas->rows / canvas->scale,
+    canvas->columns / canvas->scale, canvas->rows / canvas->scale,
+    0, FALSE, NULL, deviceInfo);
+
+  free(raster);
+
+}
+
+/*
+ * Paints a circle on the canvas. The edges of the fill and the stroke are
+ * smoothed by using the distance of each pixel from them as its coverage.
+ */
+static void TikZ_PaintCircle(tikzDevDesc *tikzInfo, const pGEcontext plotParams,
+    TikZ_DrawOps ops, double x, double y, double r){
+
+  TikZ_Canvas *canvas = &tikzInfo->canvas;
+  double halfWidth, reach, distance;
+  int column, row, firstColumn, lastColumn, firstRow, lastRow;
+
+  x = (x - canvas->left) * canvas->scale;
+  y = (canvas->top - y) * canvas->scale;
+  r *= canvas->scale;
+  halfWidth = (ops & DRAWOP_DRAW) ? 0.2 * plotParams->lwd * canvas->scale : 0;
+  reach = r + halfWidth + 1;
+
+  firstColumn = canvasIndex(floor(x - reach), canvas->columns);
+  lastColumn = canvasIndex(ceil(x + reach), canvas->columns);
+  firstRow = canvasIndex(floor(y - reach), canvas->rows);
+  lastRow = canvasIndex(ceil(y + reach), canvas->rows);
+
+  for ( row = firstRow; row <= lastRow; row++ ) {
+    for ( column = firstColumn; column <= lastColumn; column++ ) {
+      distance = hypot(column + 0.5 - x, row + 0.5 - y);
+      if ( ops & DRAWOP_FILL )
+        paintPixel(canvas, column, row, plotParams->fill, r - distance + 0.5);
+      if ( ops & DRAWOP_DRAW )
+        paintPixel(canvas, column, row, plotParams->col,
+          halfWidth - fabs(distance - r) + 0.5);
+    }
+  }
+
+}
+
+/*
+ * Paints a shape made of `npoly` runs of vertices on the canvas. Closed
+ * shapes are filled using the given rule before their outlines are stroked.
+ * Strokes are painted solid and with round ends and corners whatever the line
+ * type, which can not be told apart at the size of the dense primitives that
+ * end up here.
+ */
+static void TikZ_PaintShape(tikzDevDesc *tikzInfo, const pGEcontext plotParams,
+    TikZ_DrawOps ops, int npoly, const int *nper, const double *x, const double *y,
+    Rboolean closed, Rboolean winding){
+
+  int i, index;
+
+  if ( closed && (ops & DRAWOP_FILL) )
+    paintFill(tikzInfo, npoly, nper, x, y, winding, plotParams->fill);
+
+  if ( ops & DRAWOP_DRAW ) {
+    for ( i = 0, index = 0; i < npoly; index += nper[i++] )
+      paintStroke(&tikzInfo->canvas, nper[i], x + index, y + index, closed,
+        0.2 * plotParams->lwd, plotParams->col);
+  }
+
+}
+
+/* Blends a color over a pixel of the canvas, covering the given fraction. */
+static void paintPixel(TikZ_Canvas *canvas, int column, int row, int color,
+    double coverage){
+
+  unsigned char *pixel;
+  double alpha;
+
+  if ( coverage <= 0 )
+    return;
+
+  alpha = R_ALPHA(color) / 255.0 * fmin(coverage, 1);
+  pixel = canvas->pixels + 4 * ((size_t) row * canvas->columns + column);
+  pixel[0] = (unsigned char) (R_RED(color) * alpha + pixel[0] * (1 - alpha) + 0.5);
+  pixel[1] = (unsigned char) (R_GREEN(color) * alpha + pixel[1] * (1 - alpha) + 0.5);
+  pixel[2] = (unsigned char) (R_BLUE(color) * alpha + pixel[2] * (1 - alpha) + 0.5);
+  pixel[3] = (unsigned char) (255 * alpha + pixel[3] * (1 - alpha) + 0.5);
+
+}
+
+/*
+ * Fills the interior of a shape made of one or more closed runs of vertices.
+ * A pixel is painted when its centre lies inside according to the nonzero or
+ * the even-odd rule. The points at which the edges cross the centre line of
+ * each row are collected for all rows in one pass, grouped by row through
+ * `offsets`, and then sorted along the row.
+ */
+static void paintFill(tikzDevDesc *tikzInfo, int npoly, const int *nper,
+    const double *x, const double *y, Rboolean winding, int color){
+
+  TikZ_Canvas *canvas = &tikzInfo->canvas;
+  TikZ_Crossing *crossings, *capacity;
+  double ax, ay, bx, by, start = 0;
+  int pass, i, j, k, index, row, first, last, firstRow, lastRow;
+  int column, lastColumn, wind, total, *offsets = NULL;
+
+  firstRow = canvas->rows;
+  lastRow = -1;
+
+  for ( pass = 0; pass < 3; pass++ ) {
+    for ( k = 0, index = 0; k < npoly; index += nper[k++] ) {
+      for ( i = 0; i < nper[k]; i++ ) {
+        j = i + 1 < nper[k] ? i + 1 : 0;
+        ax = (x[index + i] - canvas->left) * canvas->scale;
+        ay = (canvas->top - y[index + i]) * canvas->scale;
+        bx = (x[index + j] - canvas->left) * canvas->scale;
+        by = (canvas->top - y[index + j]) * canvas->scale;
+
+        /* Rows whose centre lies within the vertical extent of the edge. */
+        if ( fmax(ay, by) <= 0.5 || fmin(ay, by) > canvas->rows - 0.5 )
+          continue;
+        first = canvasIndex(ceil(fmin(ay, by) - 0.5), canvas->rows);
+        last = canvasIndex(ceil(fmax(ay, by) - 0.5) - 1, canvas->rows);
+        if ( first > last )
+          continue;
+
+        if ( pass == 0 ) {
+          if ( first < firstRow ) firstRow = first;
+          if ( last > lastRow ) lastRow = last;
+        } else if ( pass == 1 ) {
+          for ( row = first; row <= last; row++ )
+            offsets[row - firstRow + 1]++;
+        } else {
+          for ( row = first; row <= last; row++ ) {
+            crossings = tikzInfo->crossings + offsets[row - firstRow]++;
+            crossings->x = ax + (row + 0.5 - ay) * (bx - ax) / (by - ay);
+            crossings->winding = by > ay ? 1 : -1;
+          }
+        }
+      }
+    }
+
+    if ( pass == 0 ) {
+      if ( firstRow > lastRow )
+        return;
+      offsets = (int *) calloc(lastRow - firstRow + 2, sizeof(int));
+      if ( offsets == NULL )
+        error("The tikzDevice was unable to allocate memory for a raster image.");
+    } else if ( pass == 1 ) {
+      for ( row = 1; row <= lastRow - firstRow + 1; row++ )
+        offsets[row] += offsets[row - 1];
+
+      total = offsets[lastRow - firstRow + 1];
+      if ( total > tikzInfo->crossingCapacity ) {
+        capacity = (TikZ_Crossing *) realloc(tikzInfo->crossings,
+          total * sizeof(TikZ_Crossing));
+        if ( capacity == NULL ) {
+          free(offsets);
+          error("The tikzDevice was unable to allocate memory for a raster image.");
+        }
+        tikzInfo->crossings = capacity;
+        tikzInfo->crossingCapacity = total;
+      }
+    }
+  }
+
+  /*
+   * Filling advanced each offset to the start of the following row, so the
+   * crossings of a row run from the offset before it to its own.
+   */
+  for ( row = firstRow; row <= lastRow; row++ ) {
+    first = row > firstRow ? offsets[row - firstRow - 1] : 0;
+    last = offsets[row - firstRow];
+    crossings = tikzInfo->crossings + first;
+    qsort(crossings, last - first, sizeof(TikZ_Crossing), compareCrossings);
+
+    for ( i = 0, wind = 0; i < last - first; i++ ) {
+      if ( wind == 0 )
+        start = crossings[i].x;
+      wind = winding ? wind + crossings[i].winding : !wind;
+      if ( wind != 0 )
+        continue;
+
+      /* Paint the pixels whose centres lie between the two crossings. */
+      if ( crossings[i].x <= 0.5 || start > canvas->columns - 0.5 )
+        continue;
+      column = canvasIndex(ceil(start - 0.5), canvas->columns);
+      lastColumn = canvasIndex(ceil(crossings[i].x - 0.5) - 1, canvas->columns);
+      for ( ; column <= lastColumn; column++ )
+        paintPixel(canvas, column, row, color, 1);
+    }
+  }
+
+  free(offsets);
+
+}
+
+/*
+ * Strokes a run of vertices with a line of the given half width in points.
+ * Each segment is painted as a capsule, and only the part of each row that
+ * lies within reach of the segment is visited so that long diagonal
+ * segments do not cost the area of their bounding box.
+ *
+ * Neighbouring segments overlap at their joints and along their smoothed
+ * edges, where a transparent stroke must not be blended twice. The coverage
+ * of all segments is therefore collected first, keeping the highest value
+ * for each pixel, and blended once at the end. A single segment is blended
+ * as it is painted.
+ */
+static void paintStroke(TikZ_Canvas *canvas, int n, const double *x,
+    const double *y, Rboolean closed, double halfWidth, int color){
+
+  double ax, ay, bx, by, dx, dy, length, reach, t, t0, t1, distance, cover;
+  double minX, minY, maxX, maxY;
+  int i, j, column, row, firstRow, lastRow, lastColumn, segments;
+  int windowColumn = 0, windowRow = 0, windowColumns = 0, windowRows = 0;
+  Rboolean direct;
+  size_t size;
+  float *cell;
+
+  halfWidth *= canvas->scale;
+  reach = halfWidth + 1;
+  segments = closed ? n : n - 1;
+  direct = segments <= 1;
+
+  if ( !direct ) {
+    minX = maxX = (x[0] - canvas->left) * canvas->scale;
+    minY = maxY = (canvas->top - y[0]) * canvas->scale;
+    for ( i = 1; i < n; i++ ) {
+      ax = (x[i] - canvas->left) * canvas->scale;
+      ay = (canvas->top - y[i]) * canvas->scale;
+      minX = fmin(minX, ax);
+      maxX = fmax(maxX, ax);
+      minY = fmin(minY, ay);
+      maxY = fmax(maxY, ay);
+    }
+
+    windowColumn = canvasIndex(floor(minX - reach), canvas->columns);
+    windowColumns = canvasIndex(ceil(maxX + reach), canvas->columns) -
+      windowColumn + 1;
+    windowRow = canvasIndex(floor(minY - reach), canvas->rows);
+    windowRows = canvasIndex(ceil(maxY + reach), canvas->rows) - windowRow + 1;
+
+    size = (size_t) windowColumns * windowRows;
+    if ( size > canvas->coverageCapacity ) {
+      free(canvas->coverage);
+      canvas->coverage = (float *) malloc(size * sizeof(float));
+      if ( canvas->coverage == NULL ) {
+        canvas->coverageCapacity = 0;
+        error("The tikzDevice was unable to allocate memory for a raster image.");
+      }
+      canvas->coverageCapacity = size;
+    }
+    memset(canvas->coverage, 0, size * sizeof(float));
+  }
+
+  for ( i = 0; i < segments; i++ ) {
+    j = i + 1 < n ? i + 1 : 0;
+    ax = (x[i] - canvas->left) * canvas->scale;
+    ay = (canvas->top - y[i]) * canvas->scale;
+    bx = (x[j] - canvas->left) * canvas->scale;
+    by = (canvas->top - y[j]) * canvas->scale;
+    dx = bx - ax;
+    dy = by - ay;
+    length = dx * dx + dy * dy;
+
+    firstRow = canvasIndex(floor(fmin(ay, by) - reach), canvas->rows);
+    lastRow = canvasIndex(ceil(fmax(ay, by) + reach), canvas->rows);
+
+    for ( row = firstRow; row <= lastRow; row++ ) {
+      /* The part of the segment within reach of this row. */
+      if ( fabs(dy) > 1e-9 ) {
+        t0 = (row + 0.5 - reach - ay) / dy;
+        t1 = (row + 0.5 + reach - ay) / dy;
+        t = fmin(t0, t1);
+        t1 = fmin(fmax(t0, t1), 1);
+        t0 = fmax(t, 0);
+        if ( t0 > t1 )
+          continue;
+      } else {
+        t0 = 0;
+        t1 = 1;
+      }
+
+      column = canvasIndex(floor(fmin(ax + t0 * dx, ax + t1 * dx) - reach),
+        canvas->columns);
+      lastColumn = canvasIndex(ceil(fmax(ax + t0 * dx, ax + t1 * dx) + reach),
+        canvas->columns);
+
+      for ( ; column <= lastColumn; column++ ) {
+        t = length > 0 ?
+          ((column + 0.5 - ax) * dx + (row + 0.5 - ay) * dy) / length : 0;
+        t = fmin(fmax(t, 0), 1);
+        distance = hypot(ax + t * dx - column - 0.5, ay + t * dy - row - 0.5);
+        cover = halfWidth - distance + 0.5;
+        if ( direct ) {
+          paintPixel(canvas, column, row, color, cover);
+        } else {
+          cell = canvas->coverage + (size_t) (row - windowRow) * windowColumns +
+            (column - windowColumn);
+          if ( cover > *cell )
+            *cell = (float) cover;
+        }
+      }
+    }
+  }
+
+  if ( direct )
+    return;
+
+  for ( row = 0; row < windowRows; row++ ) {
+    cell = canvas->coverage + (size_t) row * windowColumns;
+    for ( column = 0; column < windowColumns; column++ )
+      paintPixel(canvas, windowColumn + column, windowRow + row, color,
+        cell[column]);
+  }
+
+}
+
+/*
+ * Clamps a pixel position to the range of valid indices before converting
+ * it, so that shapes far outside the canvas do not overflow an int.
+ */
+static int canvasIndex(double position, int count){
+  return (int) fmin(fmax(position, 0), count - 1);
+}
+
+static int compareCrossings(const void *a, const void *b){
+
+  double difference = ((const TikZ_Crossing *) a)->x - ((const TikZ_Crossing *) b)->x;
+
+  return (difference > 0) - (difference < 0);
+
+}
+
+/*
+ * Holds back a rectangle that is filled but not outlined if it lines up with
+ * the grid of those held back before it. Returns FALSE if the rectangle must
+ * be written as usual, after writing out any grid it does not belong to.
+ *
+ * The first rectangle of a run sets the size of the cells and the origin of
+ * the grid. Later ones must have the same size and sit a whole number of
+ * cells away from the first. A cell that is drawn twice ends the run so that
+ * the order in which overlapping rectangles are painted is kept.
+ */
+static Rboolean TikZ_CollectTile(double x0, double y0, double x1, double y1,
+    const pGEcontext plotParams, pDevDesc deviceInfo){
+
+  tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
+  double left = fmin(x0, x1), bottom = fmin(y0, y1);
+  double width = fabs(x1 - x0), height = fabs(y1 - y0), column = 0, row = 0;
+  int cell[2];
+  TikZ_Tile *tile;
+  Rboolean created;
+
+  if ( !tikzInfo->rasterizeTiles || TikZ_GetDrawOps(plotParams) != DRAWOP_FILL ||
+      !(width > 0) || !(height > 0) ) {
+    TikZ_FlushTiles(deviceInfo);
+    return FALSE;
+  }
+
+  if ( tikzInfo->tileCount > 0 ) {
+    column = (left - tikzInfo->tileLeft) / tikzInfo->tileWidth;
+    row = (bottom - tikzInfo->tileBottom) / tikzInfo->tileHeight;
+    if ( fabs(width - tikzInfo->tileWidth) > TIKZ_TILE_TOLERANCE * tikzInfo->tileWidth ||
+        fabs(height - tikzInfo->tileHeight) > TIKZ_TILE_TOLERANCE * tikzInfo->tileHeight ||
+        fabs(column - nearbyint(column)) > TIKZ_TILE_TOLERANCE ||
+        fabs(row - nearbyint(row)) > TIKZ_TILE_TOLERANCE ||
+        fabs(column) > 1e8 || fabs(row) > 1e8 )
+      TikZ_FlushTiles(deviceInfo);
+  }
+
+  if ( tikzInfo->tileCount == 0 ) {
+    tikzInfo->tileLeft = left;
+    tikzInfo->tileBottom = bottom;
+    tikzInfo->tileWidth = width;
+    tikzInfo->tileHeight = height;
+    tikzInfo->tileParams = *plotParams;
+    column = 0;
+    row = 0;
+  }
+
+  cell[0] = (int) nearbyint(column);
+  cell[1] = (int) nearbyint(row);
+  TikZ_DictionaryInsert(&tikzInfo->tileCells, (const char *) cell,
+    sizeof(cell), &created);
+  if ( !created ) {
+    TikZ_FlushTiles(deviceInfo);
+    return TikZ_CollectTile(x0, y0, x1, y1, plotParams, deviceInfo);
+  }
+
+  if ( tikzInfo->tileCount == tikzInfo->tileCapacity ) {
+    int capacity = tikzInfo->tileCapacity > 0 ? 2 * tikzInfo->tileCapacity : 1024;
+    tile = (TikZ_Tile *) realloc(tikzInfo->tiles, capacity * sizeof(TikZ_Tile));
+    if ( tile == NULL )
+      error("The tikzDevice was unable to allocate memory for shapes.");
+    tikzInfo->tiles = tile;
+    tikzInfo->tileCapacity = capacity;
+  }
+
+  tile = tikzInfo->tiles + tikzInfo->tileCount++;
+  tile->x0 = x0;
+  tile->y0 = y0;
+  tile->x1 = x1;
+  tile->y1 = y1;
+  tile->column = cell[0];
+  tile->row = cell[1];
+  tile->fill = plotParams->fill;
+
+  return TRUE;
+
+}
+
+/*
+ * Writes out the rectangles held back by `TikZ_CollectTile`. A grid with
+ * enough cells, most of which are filled, becomes a raster with one pixel per
+ * cell that is scaled up without interpolation. Cells that were not drawn are
+ * left transparent. Anything else is written as ordinary rectangles.
+ *
+ * Held back rectangles are always newer than anything painted on the canvas
+ * of the raster budget, so the canvas is written out first.
+ */
+static void TikZ_FlushTiles(pDevDesc deviceInfo){
+
+  tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
+  int i, count = tikzInfo->tileCount, columns, rows;
+  int firstColumn, lastColumn, firstRow, lastRow;
+  unsigned int *raster;
+  TikZ_Tile *tile;
+
+  if ( count == 0 )
+    return;
+
+  /* Empty the run first, the routines below check for held back tiles. */
+  tikzInfo->tileCount = 0;
+  TikZ_DictionaryClear(&tikzInfo->tileCells);
+  TikZ_FlushCanvas(deviceInfo);
+
+  firstColumn = lastColumn = tikzInfo->tiles[0].column;
+  firstRow = lastRow = tikzInfo->tiles[0].row;
+  for ( i = 1; i < count; i++ ) {
+    tile = tikzInfo->tiles + i;
+    if ( tile->column < firstColumn ) firstColumn = tile->column;
+    if ( tile->column > lastColumn ) lastColumn = tile->column;
+    if ( tile->row < firstRow ) firstRow = tile->row;
+    if ( tile->row > lastRow ) lastRow = tile->row;
+  }
+  columns = lastColumn - firstColumn + 1;
+  rows = lastRow - firstRow + 1;
+
+  if ( count < TIKZ_MIN_TILES || (double) columns * rows > 4.0 * count ||
+      (double) columns * rows > TIKZ_MAX_CANVAS_PIXELS ) {
+    for ( i = 0; i < count; i++ ) {
+      tile = tikzInfo->tiles + i;
+      tikzInfo->tileParams.fill = tile->fill;
+      TikZ_WriteRectangle(tile->x0, tile->y0, tile->x1, tile->y1,
+        &tikzInfo->tileParams, deviceInfo);
+    }
+    return;
+  }
+
+  raster = (unsigned int *) calloc((size_t) columns * rows, sizeof(unsigned int));
+  if ( raster == NULL )
+    error("The tikzDevice was unable to allocate memory for a raster image.");
+
+  /* The first row of a raster is the top of the image. */
+  for ( i = 0; i < count; i++ ) {
+    tile = tikzInfo->tiles + i;
+    raster[(size_t) (lastRow - tile->row) * columns + tile->column - firstColumn] =
+      tile->fill;
+  }
+
+  TikZ_Raster(raster, columns, rows,
+    tikzInfo->tileLeft + firstColumn * tikzInfo->tileWidth,
+    tikzInfo->tileBottom + firstRow * tikzInfo->tileHeight,
+    columns * tikzInfo->tileWidth, rows * tikzInfo->tileHeight,
+    0, FALSE, &tikzInfo->tileParams, deviceInfo);
+
+  free(raster);
+
+}
+
+/*
+ * Holds back a circle, rectangle, line, polyline or polygon so that it can be
+ * written in a better order by `TikZ_FlushHeld`. Rectangles and lines pass
+ * their two corners or ends, circles their center and radius. Returns FALSE
+ * if the primitive must be drawn right away, as happens while the held
+ * primitives are being written out.
+ */
+static Rboolean TikZ_HoldPrimitive(const pGEcontext plotParams,
+    pDevDesc deviceInfo, TikZ_HeldKind kind, int n, double *x, double *y,
+    double r){
+
+  tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
+  TikZ_DrawOps ops = TikZ_GetDrawOps(plotParams);
+  double reach;
+  TikZ_Held *held;
+  int i;
+
+  if ( !tikzInfo->reorderPrimitives || tikzInfo->heldReplay || n < 1 )
+    return FALSE;
+
+  if ( tikzInfo->heldCount == TIKZ_MAX_HELD )
+    TikZ_FlushHeld(deviceInfo);
+
+  if ( tikzInfo->heldCount == tikzInfo->heldCapacity ) {
+    int capacity = tikzInfo->heldCapacity > 0 ? 2 * tikzInfo->heldCapacity : 1024;
+    held = (TikZ_Held *) realloc(tikzInfo->held, capacity * sizeof(TikZ_Held));
+    if ( held == NULL )
+      error("The tikzDevice was unable to allocate memory for shapes.");
+    tikzInfo->held = held;
+    tikzInfo->heldCapacity = capacity;
+  }
+
+  if ( tikzInfo->heldValueCount + 2 * n > tikzInfo->heldValueCapacity ) {
+    size_t capacity = tikzInfo->heldValueCapacity > 0 ?
+      tikzInfo->heldValueCapacity : 4096;
+    while ( capacity < tikzInfo->heldValueCount + 2 * n )
+      capacity *= 2;
+    double *values = (double *) realloc(tikzInfo->heldValues,
+      capacity * sizeof(double));
+    if ( values == NULL )
+      error("The tikzDevice was unable to allocate memory for vertices.");
+    tikzInfo->heldValues = values;
+    tikzInfo->heldValueCapacity = capacity;
+  }
+
+  /* Polylines are never filled, see `TikZ_Polyline`. */
+  if ( kind == TIKZ_HELD_POLYLINE )
+    ops &= DRAWOP_DRAW;
+  reach = TikZ_StrokeReach(plotParams, ops) + 1.0 / tikzInfo->coordScale;
+
+  if ( tikzInfo->heldCount == 0 )
+    tikzInfo->heldParams = *plotParams;
+
+  held = tikzInfo->held + tikzInfo->heldCount;
+  held->kind = kind;
+  held->n = n;
+  held->values = tikzInfo->heldValueCount;
+  held->r = r;
+  held->left = held->right = x[0];
+  held->bottom = held->top = y[0];
+  for ( i = 0; i < n; i++ ) {
+    held->left = fmin(held->left, x[i]);
+    held->right = fmax(held->right, x[i]);
+    held->bottom = fmin(held->bottom, y[i]);
+    held->top = fmax(held->top, y[i]);
+  }
+  held->left -= r + reach;
+  held->bottom -= r + reach;
+  held->right += r + reach;
+  held->top += r + reach;
+  held->col = plotParams->col;
+  held->fill = plotParams->fill;
+  held->lty = plotParams->lty;
+  held->lwd = plotParams->lwd;
+  held->lmitre = plotParams->lmitre;
+  held->lend = plotParams->lend;
+  held->ljoin = plotParams->ljoin;
+  held->cex = plotParams->cex;
+  held->ps = plotParams->ps;
+  held->gamma = plotParams->gamma;
+  held->index = tikzInfo->heldCount;
+
+  memcpy(tikzInfo->heldValues + tikzInfo->heldValueCount, x, n * sizeof(double));
+  memcpy(tikzInfo->heldValues + tikzInfo->heldValueCount + n, y, n * sizeof(double));
+  tikzInfo->heldValueCount += 2 * n;
+  tikzInfo->heldCount++;
+
+  return TRUE;
+
+}
+
+/*
+ * Writes out the primitives held back by `TikZ_HoldPrimitive`. The order in
+ * which primitives are painted can only be seen where they overlap, so those
+ * that do not may be written in any order. Primitives of the same kind drawn
+ * with the same parameters, a `style`, are brought together where possible so
+ * that they can share a path and the definitions of their colors.
+ *
+ * Each primitive is given a `layer`: the lowest one that is above every
+ * earlier, overlapping primitive of another style and not below any of the
+ * same style. The primitives are then written layer by layer, grouped by
+ * style within a layer and in their original order within a group, which
+ * keeps every pair that overlaps in the order it was drawn in.
+ *
+ * Overlapping primitives are found with a grid over the page. Each cell keeps
+ * the highest layer of the primitives touching it, the style of that
+ * primitive and the highest layer among those of any other style, which is
+ * all that is needed to place the next primitive. Primitives that only share
+ * a cell are treated as if they overlapped, which errs on the side of
+ * keeping the original order.
+ */
+static void TikZ_FlushHeld(pDevDesc deviceInfo){
+
+  tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
+  TikZ_Held *held = tikzInfo->held, *primitive;
+  int count = tikzInfo->heldCount, size, *cells, *cell, i, column, row;
+  int firstColumn, lastColumn, firstRow, lastRow, layer, candidate;
+  double width = fmax(deviceInfo->right, 1), height = fmax(deviceInfo->top, 1);
+  TikZ_Dictionary styles = { NULL, 0, 0 };
+  TikZ_DictionaryEntry *entry;
+  Rboolean created;
+  R_GE_gcontext params;
+  double *x, *y;
+  struct {
+    int kind, col, fill, lty, lend, ljoin;
+    double lwd, lmitre;
+  } key;
+
+  if ( count == 0 )
+    return;
+
+  /* Empty the list first, the routines below check for held primitives. */
+  tikzInfo->heldCount = 0;
+  tikzInfo->heldValueCount = 0;
+
+  size = (int) ceil(sqrt((double) count));
+  if ( size > TIKZ_HELD_GRID )
+    size = TIKZ_HELD_GRID;
+
+  /* Without memory to spare, the primitives keep their order. */
+  cells = (int *) malloc((size_t) 3 * size * size * sizeof(int));
+  if ( cells != NULL ) {
+    for ( i = 0; i < 3 * size * size; i += 3 ) {
+      cells[i] = -1;
+      cells[i + 1] = 0;
+      cells[i + 2] = -1;
+    }
+  }
+
+  for ( i = 0; i < count; i++ ) {
+    primitive = held + i;
+
+    memset(&key, 0, sizeof(key));
+    key.kind = primitive->kind;
+    key.col = primitive->col;
+    key.fill = primitive->fill;
+    key.lty = primitive->lty;
+    key.lend = primitive->lend;
+    key.ljoin = primitive->ljoin;
+    key.lwd = primitive->lwd;
+    key.lmitre = primitive->lmitre;
+    entry = TikZ_DictionaryInsert(&styles, (const char *) &key, sizeof(key),
+      &created);
+    if ( created )
+      entry->value = (int) styles.count;
+    primitive->style = entry->value;
+
+    if ( cells == NULL ) {
+      primitive->layer = i;
+      continue;
+    }
+
+    firstColumn = canvasIndex(size * primitive->left / width, size);
+    lastColumn = canvasIndex(size * primitive->right / width, size);
+    firstRow = canvasIndex(size * primitive->bottom / height, size);
+    lastRow = canvasIndex(size * primitive->top / height, size);
+
+    layer = 0;
+    for ( row = firstRow; row <= lastRow; row++ )
+      for ( column = firstColumn; column <= lastColumn; column++ ) {
+        cell = cells + 3 * (row * size + column);
+        if ( cell[0] < 0 )
+          continue;
+        if ( cell[1] != primitive->style )
+          candidate = cell[0] + 1;
+        else
+          candidate = cell[2] + 1 > cell[0] ? cell[2] + 1 : cell[0];
+        if ( candidate > layer )
+          layer = candidate;
+      }
+    primitive->layer = layer;
+
+    for ( row = firstRow; row <= lastRow; row++ )
+      for ( column = firstColumn; column <= lastColumn; column++ ) {
+        cell = cells + 3 * (row * size + column);
+        if ( cell[1] == primitive->style ) {
+          if ( layer > cell[0] )
+            cell[0] = layer;
+        } else if ( layer > cell[0] ) {
+          cell[2] = cell[0];
+          cell[0] = layer;
+          cell[1] = primitive->style;
+        } else if ( layer > cell[2] ) {
+          cell[2] = layer;
+        }
+      }
+  }
+
+  free(cells);
+  TikZ_DictionaryClear(&styles);
+  free(styles.entries);
+
+  qsort(held, count, sizeof(TikZ_Held), compareHeld);
+
+  /* The primitives are drawn through the usual routines once more. */
+  params = tikzInfo->heldParams;
+  tikzInfo->heldReplay = TRUE;
+  for ( i = 0; i < count; i++ ) {
+    primitive = held + i;
+    params.col = primitive->col;
+    params.fill = primitive->fill;
+    params.lty = primitive->lty;
+    params.lwd = primitive->lwd;
+    params.lmitre = primitive->lmitre;
+    params.lend = primitive->lend;
+    params.ljoin = primitive->ljoin;
+    params.cex = primitive->cex;
+    params.ps = primitive->ps;
+    params.gamma = primitive->gamma;
+
+    x = tikzInfo->heldValues + primitive->values;
+    y = x + primitive->n;
+    switch ( primitive->kind ) {
+      case TIKZ_HELD_CIRCLE:
+        TikZ_Circle(x[0], y[0], primitive->r, &params, deviceInfo);
+        break;
+      case TIKZ_HELD_RECTANGLE:
+        TikZ_Rectangle(x[0], y[0], x[1], y[1], &params, deviceInfo);
+        break;
+      case TIKZ_HELD_LINE:
+        TikZ_Line(x[0], y[0], x[1], y[1], &params, deviceInfo);
+        break;
+      case TIKZ_HELD_POLYLINE:
+        TikZ_Polyline(primitive->n, x, y, &params, deviceInfo);
+        break;
+      case TIKZ_HELD_POLYGON:
+        TikZ_Polygon(primitive->n, x, y, &params, deviceInfo);
+        break;
+    }
+  }
+  tikzInfo->heldReplay = FALSE;
+
+}
+
+/* Orders held primitives by layer, then by style, then as they were drawn. */
+static int compareHeld(const void *a, const void *b){
+
+  const TikZ_Held *first = (const TikZ_Held *) a, *second = (const TikZ_Held *) b;
+
+  if ( first->layer != second->layer )
+    return first->layer < second->layer ? -1 : 1;
+  if ( first->style != second->style )
+    return first->style < second->style ? -1 : 1;
+  return (first->index > second->index) - (first->index < second->index);
+
+}
+
+/*
+ * This function calculates an appropriate scaling factor for text by
+ * first calculating the ratio of the requested font size to the LaTeX
+ * base font size. The ratio is then further scaled by the value of
+ * the character expansion factor cex.
+*/
+static double
+ScaleFont( const pGEcontext plotParams, pDevDesc deviceInfo ){
+
+  // These parameters all affect the font size.
+  double baseSize = deviceInfo->startps;
+  double fontSize = plotParams->ps;
+  double cex = plotParams->cex;
+
+  double fontScale = ( fontSize / baseSize ) * cex;
+
+  return( fontScale );
+
+}
+
+
+/*==============================================================================
+
+                         Other User Callable Routines
+
+==============================================================================*/
+
+void TikZ_Annotate(const char **annotation, int *size){
+  
+  //1. Get values of tikzInfo and deviceInfo
+  //2. Print out annotation 
+  pDevDesc deviceInfo = GEcurrentDevice()->dev;
+  
+  /* Shortcut pointers to variables of interest. */
+  tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
+    
+  int i = 0;
+
+  TikZ_FlushHeld(deviceInfo);
+  TikZ_FlushTiles(deviceInfo);
+  TikZ_EndBatch(tikzInfo);
+  TikZ_FlushCanvas(deviceInfo);
+    
+  if(tikzInfo->debug == TRUE)
+    printOutput(tikzInfo,"\n%% Annotating Graphic\n");
+
+  /*
+   * Annotations give absolute coordinates, so the shift of a reused scope is
+   * undone around them by shifting back to the corner of the page, which is
+   * written relative to the scope like any other point.
+   */
+  if ( tikzInfo->groupStart != (size_t) -1 ) {
+    printOutput(tikzInfo, "\\begin{scope}[shift={");
+    printCoordinate(tikzInfo, 0, 0);
+    printOutput(tikzInfo, "}]\n");
+  }
+  
+  for(i = 0; i < size[0]; ++i)
+    printOutput(tikzInfo, "%s\n", annotation[i] );
+
+  if ( tikzInfo->groupStart != (size_t) -1 )
+    printOutput(tikzInfo, "\\end{scope}\n");
+}
+
+
+/*
+ * Returns information stored in the tikzDevDesc structure of a given device.
+ */
+SEXP TikZ_DeviceInfo(SEXP device_num){
+
+  int dev_index = asInteger(device_num);
+  pDevDesc deviceInfo = GEgetDevice(dev_index - 1)->dev;
+  tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
+
+  SEXP info, names;
+  PROTECT( info = allocVector(VECSXP, 2) );
+  PROTECT( names = allocVector(STRSXP, 2) );
+
+  SET_VECTOR_ELT(info, 0, mkString(tikzInfo->outFileName));
+  SET_STRING_ELT(names, 0, mkChar("output_file"));
+
+  switch( tikzInfo->engine ){
+    case pdftex:
+      SET_VECTOR_ELT(info, 1, mkString("pdftex"));
+      break;
+    case xetex:
+      SET_VECTOR_ELT(info, 1, mkString("xetex"));
+      break;
+    case luatex:
+      SET_VECTOR_ELT(info, 1, mkString("luatex"));
+      break;
+  }
+  SET_STRING_ELT(names, 1, mkChar("engine"));
+
+
+  setAttrib(info, R_NamesSymbol, names);
+
+  UNPROTECT(2);
+  return(info);
+
+}
+
+
+/* Run R evaluations inside a context protected from things like CTRL-C */
+SEXP TikZ_EvalWithoutInterrupts(SEXP expr, SEXP envir){
+  SEXP result;
+
+  BEGIN_SUSPEND_INTERRUPTS{
+    result = eval(expr, envir);
+  }END_SUSPEND_INTERRUPTS;
+
+  return result;
+}
+
+
+/*==============================================================================
+
+                               Utility Routines
+
+==============================================================================*/
+
+/*
+ * All output produced by the device passes through `printOutput` or
+ * `writeOutput`. Instead of making a call to `vfprintf` or `Rvprintf` for every
+ * fragment, the text is formatted directly into a buffer owned by the device
+ * which is handed off by `flushOutput` once it grows larger than
+ * `outputBufferSize` or a page is finished.
+ */
+static void printOutput(tikzDevDesc *tikzInfo, const char *format, ...){
+
+  va_list ap;
+
+  va_start(ap, format);
+  TikZ_BufferPrintf(&tikzInfo->output, format, ap);
+  va_end(ap);
+
+  if ( tikzInfo->output.length >= tikzInfo->outputBufferSize )
+    flushOutput(tikzInfo);
+
+}
+
+/* Appends formatted text to the options being assembled for a path. */
+static void printStyle(tikzDevDesc *tikzInfo, const char *format, ...){
+
+  va_list ap;
+
+  va_start(ap, format);
+  TikZ_BufferPrintf(&tikzInfo->style, format, ap);
+  va_end(ap);
+
+}
+
+/* Appends a block of characters that needs no formatting to the output. */
+static void writeOutput(tikzDevDesc *tikzInfo, const char *str, size_t length){
+
+  TikZ_BufferReserve(&tikzInfo->output, length + 1);
+
+  memcpy(tikzInfo->output.data + tikzInfo->output.length, str, length);
+  tikzInfo->output.length += length;
+  tikzInfo->output.data[tikzInfo->output.length] = '\0';
+
+  if ( tikzInfo->output.length >= tikzInfo->outputBufferSize )
+    flushOutput(tikzInfo);
+
+}
+
+/*
+ * Sends the contents of the output buffer to the file or console. Output that
+ * is being kept in memory stays in the buffer until the device is closed.
+ */
+static void flushOutput(tikzDevDesc *tikzInfo){
+
+  /*
+   * Shapes recorded for occlusion culling refer to positions in the buffer,
+   * so it is kept whole until the page is finished.
+   */
+  if ( tikzInfo->output.length == 0 || tikzInfo->memory != R_NilValue ||
+      tikzInfo->shapeCount > 0 )
+    return;
+
+  /*
+   * The same goes for a scope that may still turn out to repeat an earlier
+   * one, unless it has grown too large to be worth remembering.
+   */
+  if ( tikzInfo->groupStart != (size_t) -1 ) {
+    if ( tikzInfo->output.length - tikzInfo->groupStart < TIKZ_MAX_GROUP_LENGTH )
+      return;
+    tikzInfo->groupStart = (size_t) -1;
+  }
+
+  /* Positions in the buffer mean nothing once it has been written. */
+  tikzInfo->pathStart = (size_t) -1;
+
+  if(tikzInfo->console == TRUE) {
+    /*
+     * Older versions of R format console output using a fixed size buffer, so
+     * hand the text over in pieces that will comfortably fit.
+     */
+    size_t offset, piece;
+    for ( offset = 0; offset < tikzInfo->output.length; offset += piece ) {
+      piece = tikzInfo->output.length - offset;
+      if ( piece > 4096 )
+        piece = 4096;
+      Rprintf("%.*s", (int) piece, tikzInfo->output.data + offset);
+    }
+  } else {
+    tikzInfo->fragmentWritten += tikzInfo->output.length;
+
+#ifdef TIKZ_ASYNC_WRITE
+    if ( tikzInfo->asyncWrite ) {
+      TikZ_QueueOutput(tikzInfo);
+      return;
+    }
+#endif
+    fwrite(tikzInfo->output.data, 1, tikzInfo->output.length,
+      tikzInfo->outputFile);
+  }
+
+  tikzInfo->output.length = 0;
+  tikzInfo->output.data[0] = '\0';
+
+}
+
+#ifdef TIKZ_ASYNC_WRITE
+/*
+ * Hands the output buffer to the background writer. The device owns two
+ * buffers: while the writer drains `pending`, R fills `output`. Once the
+ * writer has finished with the previous block, the two are swapped.
+ *
+ * If the thread can not be started, the device quietly falls back to
+ * writing the output itself.
+ */
+static void TikZ_QueueOutput(tikzDevDesc *tikzInfo){
+
+  TikZ_Buffer swap;
+
+  if ( !tikzInfo->writerRunning ) {
+    pthread_mutex_init(&tikzInfo->writerLock, NULL);
+    pthread_cond_init(&tikzInfo->writerSignal, NULL);
+    tikzInfo->writerStop = FALSE;
+
+    if ( pthread_create(&tikzInfo->writer, NULL, TikZ_WriterThread, tikzInfo) != 0 ) {
+      pthread_cond_destroy(&tikzInfo->writerSignal);
+      pthread_mutex_destroy(&tikzInfo->writerLock);
+      tikzInfo->asyncWrite = FALSE;
+      flushOutput(tikzInfo);
+      return;
+    }
+    tikzInfo->writerRunning = TRUE;
+  }
+
+  pthread_mutex_lock(&tikzInfo->writerLock);
+  while ( tikzInfo->pending.length > 0 )
+    pthread_cond_wait(&tikzInfo->writerSignal, &tikzInfo->writerLock);
+
+  swap = tikzInfo->pending;
+  tikzInfo->pending = tikzInfo->output;
+  tikzInfo->output = swap;
+  tikzInfo->output.length = 0;
+
+  pthread_cond_broadcast(&tikzInfo->writerSignal);
+  pthread_mutex_unlock(&tikzInfo->writerLock);
+
+  TikZ_BufferReserve(&tikzInfo->output, 0);
+  tikzInfo->output.data[0] = '\0';
+
+}
+
+/*
+ * Body of the background writer. Waits for blocks of output to appear in
+ * `pending` and writes them to the current output file. This function runs
+ * outside of the R thread and must never call into the R API, so failures are
+ * only recorded in `writerError` and reported later by `TikZ_CheckWriter`.
+ */
+static void *TikZ_WriterThread(void *data){
+
+  tikzDevDesc *tikzInfo = (tikzDevDesc *) data;
+  size_t written;
+
+  pthread_mutex_lock(&tikzInfo->writerLock);
+  for ( ;; ) {
+    while ( tikzInfo->pending.length == 0 && !tikzInfo->writerStop )
+      pthread_cond_wait(&tikzInfo->writerSignal, &tikzInfo->writerLock);
+
+    if ( tikzInfo->pending.length == 0 )
+      break;
+
+    /* The R thread does not touch `pending` until it has been emptied. */
+    pthread_mutex_unlock(&tikzInfo->writerLock);
+    written = fwrite(tikzInfo->pending.data, 1, tikzInfo->pending.length,
+      tikzInfo->outputFile);
+    pthread_mutex_lock(&tikzInfo->writerLock);
+
+    if ( written != tikzInfo->pending.length )
+      tikzInfo->writerError = TRUE;
+    tikzInfo->pending.length = 0;
+    pthread_cond_broadcast(&tikzInfo->writerSignal);
+  }
+  pthread_mutex_unlock(&tikzInfo->writerLock);
+
+  return NULL;
+
+}
+#endif
+
+/*
+ * Blocks until the background writer has written everything it was given.
+ * Must be called before the output file is closed.
+ */
+static void TikZ_WaitForWriter(tikzDevDesc *tikzInfo){
+
+#ifdef TIKZ_ASYNC_WRITE
+  if ( !tikzInfo->writerRunning )
+    return;
+
+  pthread_mutex_lock(&tikzInfo->writerLock);
+  while ( tikzInfo->pending.length > 0 )
+    pthread_cond_wait(&tikzInfo->writerSignal, &tikzInfo->writerLock);
+  pthread_mutex_unlock(&tikzInfo->writerLock);
+#endif
+
+}
+
+/*
+ * Waits for the background writer to finish and shuts it down. Since this
+ * happens while the device is being closed, a failed write is reported as a
+ * warning rather than an error.
+ */
+static void TikZ_StopWriter(tikzDevDesc *tikzInfo){
+
+#ifdef TIKZ_ASYNC_WRITE
+  if ( tikzInfo->writerRunning ) {
+    pthread_mutex_lock(&tikzInfo->writerLock);
+    tikzInfo->writerStop = TRUE;
+    pthread_cond_broadcast(&tikzInfo->writerSignal);
+    pthread_mutex_unlock(&tikzInfo->writerLock);
+
+    pthread_join(tikzInfo->writer, NULL);
+    pthread_cond_destroy(&tikzInfo->writerSignal);
+    pthread_mutex_destroy(&tikzInfo->writerLock);
+    tikzInfo->writerRunning = FALSE;
+  }
+
+  free(tikzInfo->pending.data);
+  tikzInfo->pending.data = NULL;
+
+  if ( tikzInfo->writerError ) {
+    tikzInfo->writerError = FALSE;
+    warning("The tikzDevice was unable to write all output to: %s",
+      tikzInfo->outFileName);
+  }
+#endif
+
+}
+
+/*
+ * Reports a failure of the background writer to R. Called at the start of
+ * every drawing operation, so an error surfaces on the next graphics call
+ * after the write that failed.
+ */
+static void TikZ_CheckWriter(tikzDevDesc *tikzInfo){
+
+#ifdef TIKZ_ASYNC_WRITE
+  Rboolean failed;
+
+  if ( !tikzInfo->writerRunning )
+    return;
+
+  pthread_mutex_lock(&tikzInfo->writerLock);
+  failed = tikzInfo->writerError;
+  tikzInfo->writerError = FALSE;
+  pthread_mutex_unlock(&tikzInfo->writerLock);
+
+  if ( failed )
+    error("The tikzDevice was unable to write output to: %s",
+      tikzInfo->outFileName);
+#endif
+
+}
+
+/*
+ * Coordinate formatting routines.
+ *
+ * Every coordinate used to pass through `printf` using "%6.2f", which pads
+ * numbers with spaces and has to parse the format string each time it is
+ * called. Coordinates are now converted to integers counting units of
+ * 10^-coordPrecision points and the digits are written out directly.
+ */
+
+/*
+ * Writes the fixed point representation of `value`, a number that has been
+ * scaled by 10^decimals, into `str` and returns the number of characters
+ * written. The result is not NUL terminated. If `trim` is TRUE, trailing zeros
+ * after the decimal point are dropped along with the point itself if no
+ * digits remain.
+ */
+static int formatFixed(char *str, long long value, int decimals, Rboolean trim){
+
+  char digits[TIKZ_NUMBER_LENGTH];
+  unsigned long long magnitude;
+  int i, nDigits = 0, nTrailing = 0, length = 0;
+
+  if ( value < 0 ) {
+    str[length++] = '-';
+    magnitude = -(unsigned long long) value;
+  } else {
+    magnitude = value;
+  }
+
+  /*
+   * Generate digits starting with the least significant. Always produce at
+   * least one digit in front of the decimal point.
+   */
+  do {
+    digits[nDigits++] = '0' + (magnitude % 10);
+    magnitude /= 10;
+  } while ( magnitude > 0 || nDigits <= decimals );
+
+  if ( trim )
+    while ( nTrailing < decimals && digits[nTrailing] == '0' )
+      nTrailing++;
+
+  for ( i = nDigits - 1; i >= decimals; i-- )
+    str[length++] = digits[i];
+
+  if ( nTrailing < decimals ) {
+    str[length++] = '.';
+    for ( i = decimals - 1; i >= nTrailing; i-- )
+      str[length++] = digits[i];
+  }
+
+  return length;
+
+}
+
+/* Prints a single number, such as a radius, at the coordinate precision. */
+static void printNumber(tikzDevDesc *tikzInfo, double value){
+
+  char str[TIKZ_NUMBER_LENGTH];
+  double scaled = nearbyint(value * tikzInfo->coordScale);
+
+  /* Keep absurd values from overflowing the integer conversion. */
+  scaled = fmax(fmin(scaled, 1e15), -1e15);
+
+  writeOutput(tikzInfo, str, formatFixed(str, (long long) scaled,
+    tikzInfo->coordPrecision, tikzInfo->trimZeros));
+
+}
+
+/* Prints a coordinate pair of the form (x,y). */
+static void printCoordinate(tikzDevDesc *tikzInfo, double x, double y){
+
+  printVertices(tikzInfo, 1, &x, &y, "", TIKZ_POINT_TIKZ);
+
+}
+
+/* Prints a point of the PGF basic layer, \pgfqpoint{x pt}{y pt}. */
+static void printPoint(tikzDevDesc *tikzInfo, double x, double y){
+
+  printVertices(tikzInfo, 1, &x, &y, "", TIKZ_POINT_PGF);
+
+}
+
+/*
+ * Bulk formatter used for the vertices of lines, polygons and paths. Prints
+ * `n` coordinate pairs with `separator` placed between each pair, in the
+ * syntax of TikZ, as points of the PGF basic layer or as plain numbers for a
+ * Lua table depending on `format`.
+ *
+ * Vertices are processed in blocks. All the values in a block are first scaled
+ * and rounded by `scaleVertices` and the digits are then written straight into
+ * the output buffer.
+ */
+static void printVertices(tikzDevDesc *tikzInfo, int n, double *x, double *y,
+    const char *separator, TikZ_PointFormat format){
+
+  double scaledX[TIKZ_VERTEX_BLOCK], scaledY[TIKZ_VERTEX_BLOCK];
+  int decimals = tikzInfo->coordPrecision;
+  Rboolean trim = tikzInfo->trimZeros;
+  size_t separatorLength = strlen(separator);
+  TikZ_Buffer *output = &tikzInfo->output;
+  int start, count, i;
+
+  /* The text written before, between and after the two numbers of a pair. */
+  const char *open = "(", *middle = ",", *close = ")";
+  if ( format == TIKZ_POINT_PGF ) {
+    open = "\\pgfqpoint{";
+    middle = "pt}{";
+    close = "pt}";
+  } else if ( format == TIKZ_POINT_LUA ) {
+    open = "";
+    close = "";
+  }
+  size_t openLength = strlen(open), middleLength = strlen(middle),
+    closeLength = strlen(close);
+
+  for ( start = 0; start < n; start += count ) {
+    count = n - start;
+    if ( count > TIKZ_VERTEX_BLOCK )
+      count = TIKZ_VERTEX_BLOCK;
+
+    scaleVertices(tikzInfo, count, x + start, y + start, scaledX, scaledY);
+
+    TikZ_BufferReserve(output, count * (2 * TIKZ_NUMBER_LENGTH +
+      openLength + middleLength + closeLength + separatorLength));
+    char *cursor = output->data + output->length;
+
+    for ( i = 0; i < count; i++ ) {
+      if ( start + i > 0 ) {
+        memcpy(cursor, separator, separatorLength);
+        cursor += separatorLength;
+      }
+      memcpy(cursor, open, openLength);
+      cursor += openLength;
+      cursor += formatFixed(cursor, (long long) scaledX[i], decimals, trim);
+      memcpy(cursor, middle, middleLength);
+      cursor += middleLength;
+      cursor += formatFixed(cursor, (long long) scaledY[i], decimals, trim);
+      memcpy(cursor, close, closeLength);
+      cursor += closeLength;
+    }
+
+    *cursor = '\0';
+    output->length = cursor - output->data;
+
+    if ( output->length >= tikzInfo->outputBufferSize )
+      flushOutput(tikzInfo);
+  }
+
+}
+
+/*
+ * Prints the vertices of a line using the relative coordinate syntax of TikZ.
+ * The first vertex is written as an absolute coordinate and each following
+ * vertex as `--++(dx,dy)`, an offset from the one before it.
+ *
+ * The offsets are computed from the rounded absolute positions, so the
+ * rounding errors do not accumulate along the path and every vertex lands on
+ * exactly the same spot it would occupy if it was written in absolute form.
+ */
+static void printRelativeVertices(tikzDevDesc *tikzInfo, int n, double *x, double *y){
+
+  double scaledX[TIKZ_VERTEX_BLOCK], scaledY[TIKZ_VERTEX_BLOCK];
+  double lastX = 0, lastY = 0;
+  int decimals = tikzInfo->coordPrecision;
+  Rboolean trim = tikzInfo->trimZeros;
+  TikZ_Buffer *output = &tikzInfo->output;
+  int start, count, i;
+
+  for ( start = 0; start < n; start += count ) {
+    count = n - start;
+    if ( count > TIKZ_VERTEX_BLOCK )
+      count = TIKZ_VERTEX_BLOCK;
+
+    scaleVertices(tikzInfo, count, x + start, y + start,
+      scaledX, scaledY);
+
+    TikZ_BufferReserve(output, count * (2 * TIKZ_NUMBER_LENGTH + 8));
+    char *cursor = output->data + output->length;
+
+    for ( i = 0; i < count; i++ ) {
+      if ( start + i == 0 ) {
+        *cursor++ = '(';
+        cursor += formatFixed(cursor, (long long) scaledX[i], decimals, trim);
+        *cursor++ = ',';
+        cursor += formatFixed(cursor, (long long) scaledY[i], decimals, trim);
+      } else {
+        if ( (start + i) % TIKZ_VERTICES_PER_LINE == 0 )
+          *cursor++ = '\n';
+        memcpy(cursor, "--++(", 5);
+        cursor += 5;
+        cursor += formatFixed(cursor, (long long) (scaledX[i] - lastX), decimals, trim);
+        *cursor++ = ',';
+        cursor += formatFixed(cursor, (long long) (scaledY[i] - lastY), decimals, trim);
+      }
+      *cursor++ = ')';
+
+      lastX = scaledX[i];
+      lastY = scaledY[i];
+    }
+
+    *cursor = '\0';
+    output->length = cursor - output->data;
+
+    if ( output->length >= tikzInfo->outputBufferSize )
+      flushOutput(tikzInfo);
+  }
+
+}
+
+/*
+ * Prints the vertices of a line, polygon or subpath joined by line-to
+ * operations using either absolute or relative coordinates.
+ */
+static void printPolyline(tikzDevDesc *tikzInfo, int n, double *x, double *y){
+
+  /*
+   * Long lines are read from a data file. The plot starts a new subpath at
+   * its first vertex, just like the coordinates it replaces.
+   */
+  if ( tikzInfo->dataThreshold > 0 && n >= tikzInfo->dataThreshold &&
+      TikZ_WriteDataFile(tikzInfo, n, x, y) ) {
+    if ( tikzInfo->pgfBasicLayer )
+      printOutput(tikzInfo, "\\pgfplothandlerlineto\\pgfplotxyfile{%s}",
+        TikZ_BaseName(tikzInfo->dataFileName));
+    else
+      printOutput(tikzInfo, "plot file {%s}",
+        TikZ_BaseName(tikzInfo->dataFileName));
+    return;
+  }
+
+  if ( tikzInfo->pgfBasicLayer ) {
+    printOutput(tikzInfo, "\\pgfpathmoveto{");
+    printVertices(tikzInfo, n, x, y, "}\n\t\\pgfpathlineto{", TIKZ_POINT_PGF);
+    printOutput(tikzInfo, "}");
+  } else if ( tikzInfo->relativeCoords ) {
+    printRelativeVertices(tikzInfo, n, x, y);
+  } else {
+    printVertices(tikzInfo, n, x, y, " --\n\t", TIKZ_POINT_TIKZ);
+  }
+
+}
+
+/*
+ * Writes the vertices of a line to the next data file, one `x y` pair per
+ * line, and leaves its name in `dataFileName`. The name is derived from the
+ * name of the output file like that of a raster: plot.tex gets plot_data1.dat,
+ * plot_data2.dat and so on.
+ *
+ * The text is assembled in memory first. If a file of that name already holds
+ * exactly the same text, as happens when a figure is drawn again without
+ * changes, it is left untouched so that its timestamp does not trigger a
+ * rebuild. The two are compared by length and a 64 bit FNV-1a hash.
+ *
+ * Returns FALSE if there is no output file or the data file can not be
+ * written, in which case the caller writes the coordinates inline.
+ */
+static Rboolean TikZ_WriteDataFile(tikzDevDesc *tikzInfo, int n, double *x, double *y){
+
+  double scaledX[TIKZ_VERTEX_BLOCK], scaledY[TIKZ_VERTEX_BLOCK];
+  int decimals = tikzInfo->coordPrecision;
+  Rboolean trim = tikzInfo->trimZeros;
+  TikZ_Buffer *data = &tikzInfo->data;
+  unsigned long long hash, fileHash;
+  size_t i, length, fileLength;
+  char chunk[BUFSIZ];
+  int start, count, j;
+  FILE *file;
+
+  if ( tikzInfo->console )
+    return FALSE;
+
+  data->length = 0;
+  for ( start = 0; start < n; start += count ) {
+    count = n - start;
+    if ( count > TIKZ_VERTEX_BLOCK )
+      count = TIKZ_VERTEX_BLOCK;
+
+    scaleVertices(tikzInfo, count, x + start, y + start,
+      scaledX, scaledY);
+
+    TikZ_BufferReserve(data, count * (2 * TIKZ_NUMBER_LENGTH + 2));
+    char *cursor = data->data + data->length;
+
+    for ( j = 0; j < count; j++ ) {
+      cursor += formatFixed(cursor, (long long) scaledX[j], decimals, trim);
+      *cursor++ = ' ';
+      cursor += formatFixed(cursor, (long long) scaledY[j], decimals, trim);
+      *cursor++ = '\n';
+    }
+
+    *cursor = '\0';
+    data->length = cursor - data->data;
+  }
+
+  hash = 14695981039346656037ULL;
+  for ( i = 0; i < data->length; i++ ) {
+    hash ^= (unsigned char) data->data[i];
+    hash *= 1099511628211ULL;
+  }
+
+  TikZ_SiblingFileName(tikzInfo, tikzInfo->dataFileName, "_data%d.dat",
+    tikzInfo->dataFileCount);
+
+  if ( (file = fopen(R_ExpandFileName(tikzInfo->dataFileName), "rb")) != NULL ) {
+    fileHash = 14695981039346656037ULL;
+    fileLength = 0;
+    while ( (length = fread(chunk, 1, sizeof(chunk), file)) > 0 ) {
+      for ( i = 0; i < length; i++ ) {
+        fileHash ^= (unsigned char) chunk[i];
+        fileHash *= 1099511628211ULL;
+      }
+      fileLength += length;
+    }
+    fclose(file);
+
+    if ( fileLength == data->length && fileHash == hash ) {
+      tikzInfo->dataFileCount++;
+      return TRUE;
+    }
+  }
+
+  if ( (file = fopen(R_ExpandFileName(tikzInfo->dataFileName), "wb")) == NULL ) {
+    warning("The tikzDevice was unable to create the data file: %s",
+      tikzInfo->dataFileName);
+    return FALSE;
+  }
+
+  length = fwrite(data->data, 1, data->length, file);
+  if ( fclose(file) != 0 || length != data->length ) {
+    warning("The tikzDevice was unable to write the data file: %s",
+      tikzInfo->dataFileName);
+    return FALSE;
+  }
+
+  tikzInfo->dataFileCount++;
+  return TRUE;
+
+}
+
+/*
+ * Names a file that accompanies the current output file by replacing the
+ * extension of the output file, if it has one, with `suffix`. The suffix is a
+ * format that receives `count`, so `plot.tex` becomes `plot_data1.dat`.
+ */
+static void TikZ_SiblingFileName(tikzDevDesc *tikzInfo, char *name,
+    const char *suffix, int count){
+
+  char *extension;
+
+  strcpy(name, tikzInfo->outFileName);
+  extension = strrchr(name, '.');
+  if ( extension != NULL && extension > TikZ_BaseName(name) )
+    *extension = '\0';
+  sprintf(name + strlen(name), suffix, count);
+
+}
+
+/*
+ * Returns the part of `path` after its last directory separator. Files that
+ * accompany the output file are referred to by this name, as rasters are,
+ * since TeX is run in the directory that holds the output file.
+ */
+static const char *TikZ_BaseName(const char *path){
+
+  const char *name = strrchr(path, '/');
+#ifdef _WIN32
+  const char *backslash = strrchr(path, '\\');
+  if ( backslash != NULL && (name == NULL || backslash > name) )
+    name = backslash;
+#endif
+
+  return name != NULL ? name + 1 : path;
+
+}
+
+/* Closes the subpath printed last by `printPolyline`. */
+static void printCycle(tikzDevDesc *tikzInfo){
+
+  if ( tikzInfo->pgfBasicLayer )
+    printOutput(tikzInfo, "\n\t\\pgfpathclose");
+  else
+    printOutput(tikzInfo, tikzInfo->relativeCoords ? "--cycle" : " --\n\tcycle");
+
+}
+
+/* Prints a circle of radius `r` around (x,y). */
+static void printCircle(tikzDevDesc *tikzInfo, double x, double y, double r){
+
+  if ( tikzInfo->pgfBasicLayer ) {
+    printOutput(tikzInfo, "\\pgfpathcircle{");
+    printPoint(tikzInfo, x, y);
+    printOutput(tikzInfo, "}{");
+    printNumber(tikzInfo, r);
+    printOutput(tikzInfo, "pt}");
+  } else {
+    printCoordinate(tikzInfo, x, y);
+    printOutput(tikzInfo, " circle (");
+    printNumber(tikzInfo, r);
+    printOutput(tikzInfo, ")");
+  }
+
+}
+
+/* Prints a rectangle with opposite corners (x0,y0) and (x1,y1). */
+static void printRectangle(tikzDevDesc *tikzInfo, double x0, double y0,
+    double x1, double y1){
+
+  if ( tikzInfo->pgfBasicLayer ) {
+    printOutput(tikzInfo, "\\pgfpathrectanglecorners{");
+    printPoint(tikzInfo, x0, y0);
+    printOutput(tikzInfo, "}{");
+    printPoint(tikzInfo, x1, y1);
+    printOutput(tikzInfo, "}");
+  } else {
+    printCoordinate(tikzInfo, x0, y0);
+    printOutput(tikzInfo, " rectangle ");
+    printCoordinate(tikzInfo, x1, y1);
+  }
+
+}
+
+/*
+ * Adds a subpath to the Lua table of the open path as its number of vertices
+ * followed by their coordinates.
+ */
+static void printLuaSubpath(tikzDevDesc *tikzInfo, int n, double *x, double *y){
+
+  int start, count;
+
+  TikZ_LuaValues(tikzInfo, 1);
+  printOutput(tikzInfo, "%d", n);
+
+  for ( start = 0; start < n; start += count ) {
+    count = n - start;
+    if ( count > TIKZ_LUA_CHUNK / 2 )
+      count = TIKZ_LUA_CHUNK / 2;
+
+    TikZ_LuaValues(tikzInfo, 2 * count);
+    printVertices(tikzInfo, count, x + start, y + start, ",\n", TIKZ_POINT_LUA);
+  }
+
+}
+
+/* Adds a circle to the Lua table of the open path. */
+static void printLuaCircle(tikzDevDesc *tikzInfo, double x, double y, double r){
+
+  TikZ_LuaValues(tikzInfo, 3);
+  printVertices(tikzInfo, 1, &x, &y, "", TIKZ_POINT_LUA);
+  printOutput(tikzInfo, ",");
+  printNumber(tikzInfo, r);
+
+}
+
+/*
+ * Prints a straight line from (x1,y1) to (x2,y2). If `joined` is TRUE the
+ * line continues from the end of the one printed before it and only its end
+ * point is written.
+ */
+static void printSegment(tikzDevDesc *tikzInfo, double x1, double y1,
+    double x2, double y2, Rboolean joined){
+
+  if ( tikzInfo->pgfBasicLayer ) {
+    if ( !joined ) {
+      printOutput(tikzInfo, "\\pgfpathmoveto{");
+      printPoint(tikzInfo, x1, y1);
+      printOutput(tikzInfo, "}");
+    }
+    printOutput(tikzInfo, "\\pgfpathlineto{");
+    printPoint(tikzInfo, x2, y2);
+    printOutput(tikzInfo, "}");
+  } else {
+    if ( !joined ) {
+      printCoordinate(tikzInfo, x1, y1);
+      printOutput(tikzInfo, " -- ");
+    }
+    printCoordinate(tikzInfo, x2, y2);
+  }
+
+}
+
+/*
+ * Runs the vertices of a line or polygon through the optional filters applied
+ * before output. `closed` indicates the vertices form a ring that will be
+ * closed with `cycle`.
+ *
+ * On return `outX` and `outY` point either to the original vertices or, if a
+ * filter removed some, to the scratch arrays of the device. The number of
+ * vertices to print is returned. The scratch arrays are reused by the next
+ * call, so the result must be printed before preparing another set.
+ */
+static int TikZ_PrepareVertices(tikzDevDesc *tikzInfo, int n, double *x, double *y,
+    Rboolean closed, double **outX, double **outY){
+
+  *outX = x;
+  *outY = y;
+
+  if ( n <= 2 || (tikzInfo->simplifyTolerance <= 0 && !tikzInfo->dropRedundant &&
+      (closed || tikzInfo->decimationWidth <= 0)) )
+    return n;
+
+  TikZ_ReserveVertices(tikzInfo, n);
+  memcpy(tikzInfo->vertexX, x, n * sizeof(double));
+  memcpy(tikzInfo->vertexY, y, n * sizeof(double));
+  *outX = tikzInfo->vertexX;
+  *outY = tikzInfo->vertexY;
+
+  if ( !closed && tikzInfo->decimationWidth > 0 )
+    n = decimateVertices(n, tikzInfo->vertexX, tikzInfo->vertexY,
+      tikzInfo->decimationWidth);
+
+  if ( tikzInfo->simplifyTolerance > 0 )
+    n = simplifyVertices(tikzInfo, n, tikzInfo->vertexX, tikzInfo->vertexY,
+      closed, tikzInfo->simplifyTolerance);
+
+  if ( tikzInfo->dropRedundant )
+    n = dropRedundantVertices(tikzInfo, n, tikzInfo->vertexX, tikzInfo->vertexY,
+      closed);
+
+  return n;
+
+}
+
+/* Makes sure the vertex scratch arrays can hold at least `n` vertices. */
+static void TikZ_ReserveVertices(tikzDevDesc *tikzInfo, int n){
+
+  if ( n <= tikzInfo->vertexCapacity )
+    return;
+
+  int capacity = tikzInfo->vertexCapacity > 0 ? tikzInfo->vertexCapacity : 1024;
+  while ( capacity < n )
+    capacity *= 2;
+
+  free(tikzInfo->vertexX);
+  free(tikzInfo->vertexY);
+  free(tikzInfo->vertexStack);
+  free(tikzInfo->vertexKeep);
+
+  tikzInfo->vertexX = (double *) malloc(capacity * sizeof(double));
+  tikzInfo->vertexY = (double *) malloc(capacity * sizeof(double));
+  tikzInfo->vertexStack = (int *) malloc(2 * capacity * sizeof(int));
+  tikzInfo->vertexKeep = (unsigned char *) malloc(capacity);
+  tikzInfo->vertexCapacity = capacity;
+
+  if ( tikzInfo->vertexX == NULL || tikzInfo->vertexY == NULL ||
+      tikzInfo->vertexStack == NULL || tikzInfo->vertexKeep == NULL ) {
+    tikzInfo->vertexCapacity = 0;
+    error("The tikzDevice was unable to allocate memory for vertices.");
+  }
+
+}
+
+/*
+ * Simplifies a line in place using the Douglas-Peucker algorithm. Vertices
+ * are removed only if every vertex between two kept ones lies within
+ * `tolerance` points of the segment joining them, so the simplified line
+ * never strays further than `tolerance` from the original. Returns the
+ * number of vertices that remain.
+ *
+ * The recursion of the textbook algorithm is replaced by an explicit stack of
+ * index ranges so that lines with millions of vertices can not overflow the C
+ * stack. Every range pushed on the stack corresponds to a vertex that has been
+ * kept, so the stack never holds more than `n` ranges.
+ *
+ * For a closed ring the first and last vertices may sit right next to each
+ * other, so the vertex furthest from the first one is kept as well. This
+ * stops a ring from collapsing into a single segment.
+ */
+static int simplifyVertices(tikzDevDesc *tikzInfo, int n, double *x, double *y,
+    Rboolean closed, double tolerance){
+
+  int *stack = tikzInfo->vertexStack;
+  unsigned char *keep = tikzInfo->vertexKeep;
+  double tolerance2 = tolerance * tolerance;
+  int top = 0, first, last, furthest, i, kept;
+  double dx, dy, length2, t, px, py, distance2, maxDistance2;
+
+  memset(keep, 0, n);
+  keep[0] = keep[n - 1] = 1;
+
+  if ( closed ) {
+    furthest = 0;
+    maxDistance2 = 0;
+    for ( i = 1; i < n - 1; i++ ) {
+      dx = x[i] - x[0];
+      dy = y[i] - y[0];
+      if ( dx * dx + dy * dy > maxDistance2 ) {
+        maxDistance2 = dx * dx + dy * dy;
+        furthest = i;
+      }
+    }
+  } else {
+    furthest = 0;
+  }
+
+  if ( furthest > 0 ) {
+    keep[furthest] = 1;
+    stack[top++] = 0; stack[top++] = furthest;
+    stack[top++] = furthest; stack[top++] = n - 1;
+  } else {
+    stack[top++] = 0; stack[top++] = n - 1;
+  }
+
+  while ( top > 0 ) {
+    last = stack[--top];
+    first = stack[--top];
+    if ( last - first < 2 )
+      continue;
+
+    dx = x[last] - x[first];
+    dy = y[last] - y[first];
+    length2 = dx * dx + dy * dy;
+
+    furthest = first;
+    maxDistance2 = tolerance2;
+    for ( i = first + 1; i < last; i++ ) {
+      /* Squared distance from vertex i to the segment first--last. */
+      px = x[i] - x[first];
+      py = y[i] - y[first];
+      if ( length2 > 0 ) {
+        t = (px * dx + py * dy) / length2;
+        t = t < 0 ? 0 : (t > 1 ? 1 : t);
+        px -= t * dx;
+        py -= t * dy;
+      }
+      distance2 = px * px + py * py;
+      if ( distance2 > maxDistance2 ) {
+        maxDistance2 = distance2;
+        furthest = i;
+      }
+    }
+
+    if ( furthest > first ) {
+      keep[furthest] = 1;
+      stack[top++] = first; stack[top++] = furthest;
+      stack[top++] = furthest; stack[top++] = last;
+    }
+  }
+
+  for ( i = 0, kept = 0; i < n; i++ ) {
+    if ( keep[i] ) {
+      x[kept] = x[i];
+      y[kept] = y[i];
+      kept++;
+    }
+  }
+
+  return kept;
+
+}
+
+/*
+ * Removes vertices that make no difference to the typeset output in a single
+ * pass. Vertices are compared after rounding to the precision they will be
+ * printed with, and a vertex is dropped if it
+ *
+ *   - rounds to the same position as the previous vertex that was kept, or
+ *   - lies exactly on the straight segment between its neighbours, so the
+ *     line continues in the same direction through it.
+ *
+ * The collinearity test uses exact integer arithmetic on the rounded values,
+ * so it is skipped for coordinates too large for the products to fit in a
+ * `long long`. The first vertex is always kept. For a closed ring a final
+ * vertex that duplicates the first one is dropped as `cycle` returns there
+ * anyway. Returns the number of vertices that remain.
+ */
+static int dropRedundantVertices(tikzDevDesc *tikzInfo, int n, double *x, double *y,
+    Rboolean closed){
+
+  double scale = tikzInfo->coordScale;
+  double limit = 1073741824.0; /* 2^30 */
+  long long ax = 0, ay = 0, bx, by, px, py;
+  int i, kept = 1;
+
+  bx = (long long) fmax(fmin(nearbyint(x[0] * scale), 1e15), -1e15);
+  by = (long long) fmax(fmin(nearbyint(y[0] * scale), 1e15), -1e15);
+
+  for ( i = 1; i < n; i++ ) {
+    double sx = nearbyint(x[i] * scale), sy = nearbyint(y[i] * scale);
+    px = (long long) fmax(fmin(sx, 1e15), -1e15);
+    py = (long long) fmax(fmin(sy, 1e15), -1e15);
+
+    /* Same position as the last vertex that was kept. */
+    if ( px == bx && py == by )
+      continue;
+
+    /*
+     * If the last kept vertex B is not the first one and sits on the segment
+     * from the vertex A before it to the new vertex P, replace it with P.
+     */
+    if ( kept >= 2 && fabs(sx) < limit && fabs(sy) < limit &&
+        llabs(ax) < limit && llabs(ay) < limit &&
+        llabs(bx) < limit && llabs(by) < limit ) {
+      long long ux = bx - ax, uy = by - ay, vx = px - bx, vy = py - by;
+      if ( ux * vy - uy * vx == 0 && ux * vx + uy * vy > 0 ) {
+        x[kept - 1] = x[i];
+        y[kept - 1] = y[i];
+        bx = px;
+        by = py;
+        continue;
+      }
+    }
+
+    x[kept] = x[i];
+    y[kept] = y[i];
+    kept++;
+    ax = bx; ay = by;
+    bx = px; by = py;
+  }
+
+  /*
+   * A line whose vertices all round to the same spot still has to be drawn,
+   * since round or square caps turn it into a dot.
+   */
+  if ( kept == 1 ) {
+    x[1] = x[n - 1];
+    y[1] = y[n - 1];
+    kept = 2;
+  }
+
+  /* A ring that returns to its starting point. */
+  if ( closed && kept > 2 &&
+      bx == (long long) fmax(fmin(nearbyint(x[0] * scale), 1e15), -1e15) &&
+      by == (long long) fmax(fmin(nearbyint(y[0] * scale), 1e15), -1e15) )
+    kept--;
+
+  return kept;
+
+}
+
+/*
+ * Thins out an open line whose x values never decrease, or never increase,
+ * as is the case for a time series. The vertices are grouped into columns
+ * `width` points wide and only the first, lowest, highest and last vertex of
+ * each column are kept, in their original order. The line drawn through them
+ * covers the same vertical range in every column as the original, so the
+ * outline of the data is preserved while a series of millions of samples is
+ * reduced to a few vertices per column. Lines that double back in x are left
+ * alone. Returns the number of vertices that remain.
+ */
+static int decimateVertices(int n, double *x, double *y, double width){
+
+  int i, start, end, low, high, kept = 0, picks[4], count, k;
+  double column;
+  Rboolean rising = FALSE, falling = FALSE;
+
+  for ( i = 1; i < n; i++ ) {
+    if ( x[i] > x[i - 1] ) rising = TRUE;
+    if ( x[i] < x[i - 1] ) falling = TRUE;
+    if ( (rising && falling) || ISNAN(x[i]) )
+      return n;
+  }
+
+  for ( start = 0; start < n; start = end ) {
+    column = floor(x[start] / width);
+    low = high = start;
+    for ( end = start + 1; end < n && floor(x[end] / width) == column; end++ ) {
+      if ( y[end] < y[low] ) low = end;
+      if ( y[end] > y[high] ) high = end;
+    }
+
+    /*
+     * Collect the vertices to keep in order of their position along the
+     * line. They never lie before `kept`, so they can be moved down in place.
+     */
+    count = 0;
+    picks[count++] = start;
+    if ( low < high ) {
+      if ( low != start ) picks[count++] = low;
+      if ( high != end - 1 ) picks[count++] = high;
+    } else {
+      if ( high != start && high != end - 1 ) picks[count++] = high;
+      if ( low != high && low != end - 1 ) picks[count++] = low;
+    }
+    if ( end - 1 != start ) picks[count++] = end - 1;
+
+    for ( k = 0; k < count; k++, kept++ ) {
+      x[kept] = x[picks[k]];
+      y[kept] = y[picks[k]];
+    }
+  }
+
+  return kept;
+
+}
+
+/*
+ * Clips the segment from (x1, y1) to (x2, y2) to `region` using the
+ * Liang-Barsky algorithm. Returns FALSE if no part of the segment lies inside
+ * the region. Otherwise end points outside of the region are moved onto its
+ * edge and those inside are left exactly as they were.
+ */
+static Rboolean clipSegment(const double *region, double *x1, double *y1,
+    double *x2, double *y2){
+
+  double dx = *x2 - *x1, dy = *y2 - *y1;
+  double p[4] = { -dx, dx, -dy, dy };
+  double q[4] = { *x1 - region[0], region[2] - *x1,
+    *y1 - region[1], region[3] - *y1 };
+  double t0 = 0, t1 = 1, t;
+  int i;
+
+  for ( i = 0; i < 4; i++ ) {
+    if ( p[i] == 0 ) {
+      /* Parallel to this edge, the segment is either all in or all out. */
+      if ( q[i] < 0 )
+        return FALSE;
+      continue;
+    }
+
+    t = q[i] / p[i];
+    if ( p[i] < 0 ) {
+      if ( t > t1 )
+        return FALSE;
+      t0 = fmax(t0, t);
+    } else {
+      if ( t < t0 )
+        return FALSE;
+      t1 = fmin(t1, t);
+    }
+  }
+
+  if ( t1 < 1 ) {
+    *x2 = *x1 + t1 * dx;
+    *y2 = *y1 + t1 * dy;
+  }
+  if ( t0 > 0 ) {
+    *x1 += t0 * dx;
+    *y1 += t0 * dy;
+  }
+
+  return TRUE;
+
+}
+
+/*
+ * Cuts a line down to the pieces that lie inside `region`. The vertices of
+ * the pieces are stored one after the other in `clippedX` and `clippedY` and
+ * the number of vertices in each piece in `clippedRuns`. Returns the number
+ * of pieces, which is 0 if the line misses the region entirely.
+ */
+static int clipPolyline(tikzDevDesc *tikzInfo, const double *region, int n,
+    double *x, double *y){
+
+  double x1, y1, x2, y2;
+  int count = 0, pieces = 0, i;
+  Rboolean open = FALSE;
+
+  /* Every segment adds at most two vertices and starts at most one piece. */
+  TikZ_ReserveClipped(tikzInfo, 2 * n);
+  double *clippedX = tikzInfo->clippedX, *clippedY = tikzInfo->clippedY;
+  int *runs = tikzInfo->clippedRuns;
+
+  for ( i = 1; i < n; i++ ) {
+    x1 = x[i - 1];
+    y1 = y[i - 1];
+    x2 = x[i];
+    y2 = y[i];
+
+    if ( !clipSegment(region, &x1, &y1, &x2, &y2) ) {
+      open = FALSE;
+      continue;
+    }
+
+    /*
+     * A segment continues the current piece if the one before it ended
+     * inside the region, otherwise it starts a new piece.
+     */
+    if ( !open ) {
+      runs[pieces++] = 1;
+      clippedX[count] = x1;
+      clippedY[count++] = y1;
+    }
+
+    runs[pieces - 1]++;
+    clippedX[count] = x2;
+    clippedY[count++] = y2;
+    open = x2 == x[i] && y2 == y[i];
+  }
+
+  return pieces;
+
+}
+
+/*
+ * Returns how far a point lies on the inner side of one edge of `region`.
+ * Edges are numbered left, bottom, right and top.
+ */
+static double edgeDistance(const double *region, int edge, double x, double y){
+
+  switch ( edge ) {
+    case 0:
+      return x - region[0];
+    case 1:
+      return y - region[1];
+    case 2:
+      return region[2] - x;
+    default:
+      return region[3] - y;
+  }
+
+}
+
+/*
+ * Clips a polygon to `region` using the Sutherland-Hodgman algorithm. Parts
+ * of the outline outside the region are replaced by runs along its edges.
+ * This works for concave and self-intersecting polygons too: the result may
+ * contain edges that double back on themselves along the border of the
+ * region, but every point inside the region is surrounded the same number of
+ * times as before, so neither fill rule changes what is painted. The region
+ * lies outside of the visible area by more than the reach of the stroke, so
+ * the new edges can not be seen either.
+ *
+ * The clipped polygon is stored in `clippedX` and `clippedY` and the number
+ * of its vertices is returned.
+ */
+static int clipPolygon(tikzDevDesc *tikzInfo, const double *region, int n,
+    double *x, double *y){
+
+  double *swap, distance, previousDistance, t;
+  int edge, count, i, previous;
+
+  for ( edge = 0; edge < 4 && n > 0; edge++ ) {
+
+    /*
+     * Each vertex adds itself and possibly a crossing to the output. The
+     * previous pass left its output in `clippedX`, which may be moved when
+     * the arrays grow.
+     */
+    TikZ_ReserveClipped(tikzInfo, 2 * n);
+    if ( edge > 0 ) {
+      x = tikzInfo->clippedX;
+      y = tikzInfo->clippedY;
+    }
+
+    count = 0;
+    previous = n - 1;
+    previousDistance = edgeDistance(region, edge, x[previous], y[previous]);
+
+    for ( i = 0; i < n; previous = i++ ) {
+      distance = edgeDistance(region, edge, x[i], y[i]);
+
+      if ( (distance >= 0) != (previousDistance >= 0) ) {
+        t = previousDistance / (previousDistance - distance);
+        tikzInfo->clippedSwapX[count] = x[previous] + t * (x[i] - x[previous]);
+        tikzInfo->clippedSwapY[count++] = y[previous] + t * (y[i] - y[previous]);
+      }
+
+      if ( distance >= 0 ) {
+        tikzInfo->clippedSwapX[count] = x[i];
+        tikzInfo->clippedSwapY[count++] = y[i];
+      }
+
+      previousDistance = distance;
+    }
+
+    /* The output of this pass becomes the input of the next one. */
+    swap = tikzInfo->clippedX;
+    tikzInfo->clippedX = tikzInfo->clippedSwapX;
+    tikzInfo->clippedSwapX = swap;
+    swap = tikzInfo->clippedY;
+    tikzInfo->clippedY = tikzInfo->clippedSwapY;
+    tikzInfo->clippedSwapY = swap;
+    n = count;
+  }
+
+  return n;
+
+}
+
+/*
+ * Makes sure the clipping scratch arrays can hold at least `n` vertices. The
+ * contents of `clippedX` and `clippedY` are preserved.
+ */
+static void TikZ_ReserveClipped(tikzDevDesc *tikzInfo, int n){
+
+  double *clippedX, *clippedY;
+
+  if ( n <= tikzInfo->clippedCapacity )
+    return;
+
+  int capacity = tikzInfo->clippedCapacity > 0 ? tikzInfo->clippedCapacity : 1024;
+  while ( capacity < n )
+    capacity *= 2;
+
+  free(tikzInfo->clippedSwapX);
+  free(tikzInfo->clippedSwapY);
+  free(tikzInfo->clippedRuns);
+
+  clippedX = (double *) realloc(tikzInfo->clippedX, capacity * sizeof(double));
+  if ( clippedX != NULL )
+    tikzInfo->clippedX = clippedX;
+  clippedY = (double *) realloc(tikzInfo->clippedY, capacity * sizeof(double));
+  if ( clippedY != NULL )
+    tikzInfo->clippedY = clippedY;
+  tikzInfo->clippedSwapX = (double *) malloc(capacity * sizeof(double));
+  tikzInfo->clippedSwapY = (double *) malloc(capacity * sizeof(double));
+  tikzInfo->clippedRuns = (int *) malloc(capacity * sizeof(int));
+  tikzInfo->clippedCapacity = capacity;
+
+  if ( clippedX == NULL || clippedY == NULL ||
+      tikzInfo->clippedSwapX == NULL || tikzInfo->clippedSwapY == NULL ||
+      tikzInfo->clippedRuns == NULL ) {
+    tikzInfo->clippedCapacity = 0;
+    error("The tikzDevice was unable to allocate memory for vertices.");
+  }
+
+}
+
+/*
+ * Scales a block of vertices to units of the coordinate precision and rounds
+ * them to whole numbers. The loop has no dependencies between iterations so
+ * that compilers can vectorize it using whatever instructions the CPU
+ * supports. Absurd values are clamped so that they can not overflow the
+ * integer conversions done by the formatting routines.
+ *
+ * Positions are taken relative to the origin of a reused scope, which is
+ * normally (0,0).
+ */
+static void scaleVertices(tikzDevDesc *tikzInfo, int n, double *x, double *y,
+    double *scaledX, double *scaledY){
+
+  double scale = tikzInfo->coordScale;
+  double originX = tikzInfo->originX, originY = tikzInfo->originY;
+  int i;
+  for ( i = 0; i < n; i++ ) {
+    scaledX[i] = fmax(fmin(nearbyint((x[i] - originX) * scale), 1e15), -1e15);
+    scaledY[i] = fmax(fmin(nearbyint((y[i] - originY) * scale), 1e15), -1e15);
+  }
+
+}
+
+/* Formats text and appends it to the end of a buffer. */
+static void TikZ_BufferPrintf(TikZ_Buffer *buffer, const char *format, va_list ap){
+
+  int length;
+  size_t available;
+  va_list aq;
+
+  TikZ_BufferReserve(buffer, 128);
+
+  va_copy(aq, ap);
+
+  available = buffer->capacity - buffer->length;
+  length = vsnprintf(buffer->data + buffer->length, available, format, ap);
+
+  /*
+   * vsnprintf tells us how many characters it wanted to write. If the text did
+   * not fit, make room and format it again.
+   */
+  if ( length >= 0 && (size_t) length >= available ) {
+    TikZ_BufferReserve(buffer, length + 1);
+    vsnprintf(buffer->data + buffer->length, length + 1, format, aq);
+  }
+
+  va_end(aq);
+
+  if ( length > 0 )
+    buffer->length += length;
+
+}
+
+/*
+ * Ensures a buffer has room for at least `extra` more characters. The
+ * capacity is doubled as needed so that appending to the buffer stays cheap
+ * no matter how much output a plot produces.
+ */
+static void TikZ_BufferReserve(TikZ_Buffer *buffer, size_t extra){
+
+  size_t needed = buffer->length + extra + 1;
+  if ( needed <= buffer->capacity )
+    return;
+
+  size_t capacity = buffer->capacity > 0 ? buffer->capacity : 1024;
+  while ( capacity < needed )
+    capacity *= 2;
+
+  char *data = (char *) realloc(buffer->data, capacity);
+  if ( data == NULL )
+    error("The tikzDevice was unable to allocate memory for output.");
+
+  buffer->data = data;
+  buffer->capacity = capacity;
+  if ( buffer->length == 0 )
+    buffer->data[0] = '\0';
+
+}
+
+
+/*
+ * Finds the entry for `key` in a dictionary. If the key is not present, a new
+ * entry is added with a copy of the key and `created` is set to TRUE.
+ *
+ * The dictionary is an open addressing hash table using FNV-1a hashes and
+ * linear probing. The table is kept at most half full.
+ */
+static TikZ_DictionaryEntry *TikZ_DictionaryInsert(TikZ_Dictionary *dict,
+    const char *key, size_t keyLength, Rboolean *created){
+
+  size_t i, mask;
+  unsigned int hash = 2166136261U;
+  TikZ_DictionaryEntry *entry;
+
+  for ( i = 0; i < keyLength; i++ ) {
+    hash ^= (unsigned char) key[i];
+    hash *= 16777619U;
+  }
+
+  if ( 2 * (dict->count + 1) > dict->capacity ) {
+    /* Grow the table and move the existing entries into it. */
+    size_t j, capacity = dict->capacity > 0 ? 2 * dict->capacity : 64;
+    TikZ_DictionaryEntry *entries = (TikZ_DictionaryEntry *)
+      calloc(capacity, sizeof(TikZ_DictionaryEntry));
+    if ( entries == NULL )
+      error("The tikzDevice was unable to allocate memory for a dictionary.");
+
+    for ( j = 0; j < dict->capacity; j++ ) {
+      if ( dict->entries[j].key == NULL )
+        continue;
+      i = dict->entries[j].hash & (capacity - 1);
+      while ( entries[i].key != NULL )
+        i = (i + 1) & (capacity - 1);
+      entries[i] = dict->entries[j];
+    }
+
+    free(dict->entries);
+    dict->entries = entries;
+    dict->capacity = capacity;
+  }
+
+  mask = dict->capacity - 1;
+  for ( i = hash & mask; dict->entries[i].key != NULL; i = (i + 1) & mask ) {
+    entry = &dict->entries[i];
+    if ( entry->hash == hash && entry->keyLength == keyLength &&
+        memcmp(entry->key, key, keyLength) == 0 ) {
+      *created = FALSE;
+      return entry;
+    }
+  }
+
+  entry = &dict->entries[i];
+  if ( (entry->key = (char *) malloc(keyLength + 1)) == NULL )
+    error("The tikzDevice was unable to allocate memory for a dictionary.");
+  memcpy(entry->key, key, keyLength);
+  entry->key[keyLength] = '\0';
+  entry->keyLength = keyLength;
+  entry->hash = hash;
+  entry->value = 0;
+  dict->count++;
+
+  *created = TRUE;
+  return entry;
+
+}
+
+/* Removes every entry from a dictionary but keeps the table allocated. */
+static void TikZ_DictionaryClear(TikZ_Dictionary *dict){
+
+  size_t i;
+
+  if ( dict->count == 0 )
+    return;
+
+  for ( i = 0; i < dict->capacity; i++ ) {
+    free(dict->entries[i].key);
+    dict->entries[i].key = NULL;
+  }
+  dict->count = 0;
+
+}
+
+
+/*
+ * This function is responsible for writing header information
+ * to the output file. Currently this header information includes:
+ *
+ *   - The current version number of TikZ device.
+ *   - The date on which the graphic was created.
+ *
+*/
+static void Print_TikZ_Header( tikzDevDesc *tikzInfo ){
+
+  /* Call back to R to retrieve current date and version num*/
+
+  /*
+   * Recover package namespace as the date formatting function
+   * is not exported
+  */
+  SEXP namespace;
+  PROTECT( namespace = TIKZ_NAMESPACE );
+
+
+  SEXP currentDate;
+  PROTECT(
+    currentDate = eval(lang1( install("getDateStampForTikz") ),
+      namespace )
+  );
+
+  SEXP currentVersion;
+  PROTECT(
+    currentVersion = eval(lang1( install("getTikzDeviceVersion") ),
+      namespace )
+  );
+
+  printOutput( tikzInfo, "%% Created by tikzDevice version %s on %s\n",
+    CHAR(STRING_ELT(currentVersion,0)), CHAR(STRING_ELT(currentDate,0)) );
+
+	//Specifically for TeXShop, force it to open the file with UTF-8 encoding
+	printOutput(tikzInfo, "%% !TEX encoding = UTF-8 Unicode\n");
+
+  UNPROTECT(3);
+
+}
+
+static char *Sanitize(const char *str){
+
+  
+  //Splice in escaped charaters via a callback to R
+  
+  //Call out to R to retrieve the sanitizeTexString function.
+  SEXP sanitizeFun = findFun( install("sanitizeTexString"), R_GlobalEnv );
+
+  /*
+   * Create a SEXP that will be the R function call. The SEXP will
+   * have four components- the R function being calledand the string 
+   * being passed. Therefore it is allocated as a  LANGSXP
+   * vector of length 2. This is done inside a PROTECT() function
+   * to keep the R garbage collector from saying "Hmmm... what's
+   * this? Looks like noone is using it so I guess I will nuke it."
+  */
+  SEXP RCallBack;
+  PROTECT( RCallBack = allocVector(LANGSXP,2) );
+
+  // Place the function into the first slot of the SEXP.
+  SETCAR( RCallBack, sanitizeFun );
+  
+  // Place the string into the second slot of the SEXP.
+  SETCADR( RCallBack, mkString( str ) );
+  // Tag the string with a name, this name coressponds to the
+  // dummy argument of the R function sanitizeTexString.
+  SET_TAG( CDR( RCallBack ), install("string") );
+
+  /*
    * Call the R function, capture the result.
   */
   SEXP RSanitizedString;
@@ -2054,6 +6299,15 @@ static void TikZ_CheckState(pDevDesc deviceInfo)
 {
   tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
 
+  TikZ_CheckWriter(tikzInfo);
+
+  /* Anything held back was drawn before the output that follows. */
+  TikZ_FlushTiles(deviceInfo);
+
+  if( tikzInfo->pageState == TIKZ_START_PAGE ||
+      tikzInfo->clipState == TIKZ_START_CLIP )
+    TikZ_EndBatch(tikzInfo);
+
   if( tikzInfo->pageState == TIKZ_START_PAGE ) {
     /*
      * Start a new file if we are outputting to multiple files.
@@ -2072,6 +6326,18 @@ static void TikZ_CheckState(pDevDesc deviceInfo)
       printOutput(tikzInfo,
         "%% Beginning new tikzpicture 'page'\n");
 
+    /*
+     * Define the Lua functions used to paint shapes. Every page carries the
+     * definition so that it can be included in a document on its own. The
+     * characters that Lua needs but TeX treats specially are made harmless
+     * while the code is read.
+     */
+    if ( tikzInfo->luaDrawing )
+      printOutput(tikzInfo,
+        "\\begingroup\\catcode`\\%%=12 \\catcode`\\#=12 \\catcode`\\~=12 "
+        "\\catcode`\\\"=12\n\\directlua{%s}\n\\endgroup\n",
+        tikzInfo->luaCode);
+
     if ( tikzInfo->bareBones != TRUE )
       printOutput(tikzInfo, "\\begin{tikzpicture}[x=1pt,y=1pt]\n");
 
@@ -2103,21 +6369,195 @@ static void TikZ_CheckState(pDevDesc deviceInfo)
     tikzInfo->pageNum++;
   } /* End if pageState == TIKZ_START_PAGE */
 
+  TikZ_CheckFragment(tikzInfo);
+
 
   if ( tikzInfo->clipState == TIKZ_START_CLIP ) {
-    printOutput(tikzInfo, "\\begin{scope}\n");
-    printOutput(tikzInfo,
-      "\\path[clip] (%6.2f,%6.2f) rectangle (%6.2f,%6.2f);\n",
-      deviceInfo->clipLeft, deviceInfo->clipBottom,
-      deviceInfo->clipRight, deviceInfo->clipTop);
+    if ( tikzInfo->reuseGroups )
+      TikZ_StartGroup(deviceInfo);
+    else
+      printOutput(tikzInfo, "\\begin{scope}\n");
+    printOutput(tikzInfo, "\\path[clip] ");
+    printCoordinate(tikzInfo, deviceInfo->clipLeft, deviceInfo->clipBottom);
+    printOutput(tikzInfo, " rectangle ");
+    printCoordinate(tikzInfo, deviceInfo->clipRight, deviceInfo->clipTop);
+    printOutput(tikzInfo, ";\n");
 
     if ( tikzInfo->debug == TRUE )
       printOutput(tikzInfo,
         "\\path[draw=red,very thick,dashed] (%6.2f,%6.2f) rectangle (%6.2f,%6.2f);\n",
-        deviceInfo->clipLeft, deviceInfo->clipBottom,
-        deviceInfo->clipRight, deviceInfo->clipTop);
+        deviceInfo->clipLeft - tikzInfo->originX,
+        deviceInfo->clipBottom - tikzInfo->originY,
+        deviceInfo->clipRight - tikzInfo->originX,
+        deviceInfo->clipTop - tikzInfo->originY);
 
     tikzInfo->clipState = TIKZ_FINISH_CLIP;
   } /* End if clipState == TIKZ_START_CLIP */
 
 }
+
+/*
+ * Called for every primitive once its page has been started. Moves the output
+ * into the next fragment file when the current one has grown past the limits
+ * set by `fragmentSize` and `fragmentPrimitives`, ending any open batch first.
+ * The page itself only receives an \input for each fragment.
+ *
+ * Since \input reads the fragment as if its text stood in the page, and does
+ * not start a group, the colors, styles and clipping scope in effect at the
+ * end of one fragment carry over to the next just as they would in a single
+ * file. A scope that is begun in one fragment may therefore be ended in a
+ * later one.
+ *
+ * The fragment files are written by the background writer like the rest of
+ * the output, which is only waited on when switching from one file to
+ * another.
+ */
+static void TikZ_CheckFragment(tikzDevDesc *tikzInfo){
+
+  FILE *file;
+
+  if ( tikzInfo->fragmentSize == 0 && tikzInfo->fragmentPrimitives == 0 )
+    return;
+
+  if ( tikzInfo->mainFile != NULL ) {
+    /* A scope that may be reused has to stay in the buffer as a whole. */
+    if ( tikzInfo->groupStart != (size_t) -1 ||
+        ((tikzInfo->fragmentPrimitives == 0 ||
+          tikzInfo->fragmentDrawn < tikzInfo->fragmentPrimitives) &&
+        (tikzInfo->fragmentSize == 0 ||
+          tikzInfo->fragmentWritten + tikzInfo->output.length <
+            (size_t) tikzInfo->fragmentSize)) ) {
+      tikzInfo->fragmentDrawn++;
+      return;
+    }
+
+    TikZ_EndBatch(tikzInfo);
+    TikZ_EndFragment(tikzInfo);
+  }
+
+  TikZ_SiblingFileName(tikzInfo, tikzInfo->fragmentFileName, "_frag%d.tex",
+    tikzInfo->fragmentFileCount);
+
+  if ( (file = fopen(R_ExpandFileName(tikzInfo->fragmentFileName), "w")) == NULL ) {
+    tikzInfo->fragmentSize = 0;
+    tikzInfo->fragmentPrimitives = 0;
+    warning("The tikzDevice was unable to create the fragment file: %s",
+      tikzInfo->fragmentFileName);
+    return;
+  }
+
+  printOutput(tikzInfo, "\\input{%s}\n",
+    TikZ_BaseName(tikzInfo->fragmentFileName));
+  flushOutput(tikzInfo);
+  TikZ_WaitForWriter(tikzInfo);
+
+  tikzInfo->mainFile = tikzInfo->outputFile;
+  tikzInfo->outputFile = file;
+  tikzInfo->fragmentFileCount++;
+  tikzInfo->fragmentWritten = 0;
+  tikzInfo->fragmentDrawn = 1;
+
+}
+
+/*
+ * Writes out and closes the open fragment file, if any, and returns to the
+ * output file of the page. Called once all the scopes of a page are ended.
+ */
+static void TikZ_EndFragment(tikzDevDesc *tikzInfo){
+
+  if ( tikzInfo->mainFile == NULL )
+    return;
+
+  flushOutput(tikzInfo);
+  TikZ_WaitForWriter(tikzInfo);
+
+  if ( fclose(tikzInfo->outputFile) != 0 )
+    warning("The tikzDevice was unable to write the fragment file: %s",
+      tikzInfo->fragmentFileName);
+
+  tikzInfo->outputFile = tikzInfo->mainFile;
+  tikzInfo->mainFile = NULL;
+
+}
+
+/*
+ * Begins a clipping scope that may be reused. The scope is shifted to the
+ * corner of the clipping region and everything inside it is written relative
+ * to that corner, so that the panels of a faceted plot, which differ only in
+ * their position, produce exactly the same text.
+ *
+ * For the same reason nothing written inside the scope may depend on what
+ * came before it. The cached colors are forgotten, and styles, plot marks and
+ * palette colors are numbered from the start again.
+ */
+static void TikZ_StartGroup(pDevDesc deviceInfo){
+
+  tikzDevDesc *tikzInfo = (tikzDevDesc *) deviceInfo->deviceSpecific;
+
+  printOutput(tikzInfo, "\\begin{scope}[shift={");
+  printCoordinate(tikzInfo, fmin(deviceInfo->clipLeft, deviceInfo->clipRight),
+    fmin(deviceInfo->clipBottom, deviceInfo->clipTop));
+  printOutput(tikzInfo, "}]\n");
+
+  tikzInfo->originX = fmin(deviceInfo->clipLeft, deviceInfo->clipRight);
+  tikzInfo->originY = fmin(deviceInfo->clipBottom, deviceInfo->clipTop);
+
+  tikzInfo->oldFillColor = -999;
+  tikzInfo->oldDrawColor = -999;
+  TikZ_DictionaryClear(&tikzInfo->styles);
+  TikZ_DictionaryClear(&tikzInfo->marks);
+  TikZ_DictionaryClear(&tikzInfo->palette);
+  tikzInfo->styleCount = 0;
+  tikzInfo->markCount = 0;
+  tikzInfo->colorCount = 0;
+
+  tikzInfo->groupStart = tikzInfo->output.length;
+
+}
+
+/*
+ * Finishes the contents of a clipping scope, just before the scope is ended.
+ * The first time a scope is seen, it is left as it is. When the same text
+ * turns up a second time, it is replaced by a global macro definition,
+ * `\tikzdevGroupN`, followed by a use of the macro, and any further copies
+ * are replaced by the use alone. Since a copy only differs from the first in
+ * the shift of its scope, the macro draws it in the right place.
+ */
+static void TikZ_EndGroup(tikzDevDesc *tikzInfo){
+
+  TikZ_DictionaryEntry *entry;
+  Rboolean created;
+  size_t start = tikzInfo->groupStart;
+
+  tikzInfo->originX = 0;
+  tikzInfo->originY = 0;
+
+  if ( start == (size_t) -1 )
+    return;
+
+  tikzInfo->groupStart = (size_t) -1;
+  entry = TikZ_DictionaryInsert(&tikzInfo->groups, tikzInfo->output.data + start,
+    tikzInfo->output.length - start, &created);
+  if ( created )
+    return;
+
+  tikzInfo->output.length = start;
+  tikzInfo->output.data[start] = '\0';
+  tikzInfo->pathStart = (size_t) -1;
+
+  /*
+   * TeX does not allow blank lines in the argument of a macro unless it is
+   * declared \long.
+   */
+  if ( entry->value == 0 ) {
+    entry->value = ++tikzInfo->groupCount;
+    printOutput(tikzInfo,
+      "\\long\\expandafter\\gdef\\csname tikzdevGroup%d\\endcsname{\n",
+      entry->value);
+    writeOutput(tikzInfo, entry->key, entry->keyLength);
+    printOutput(tikzInfo, "}\n");
+  }
+
+  printOutput(tikzInfo, "\\csname tikzdevGroup%d\\endcsname\n", entry->value);
+
+}
@@ -25,9 +25,67 @@
 #error "This version of the tikzDevice must be compiled against R 2.12.0 or newer!"
 #endif
 
+/*
+ * Output to files may be handed to a background thread so that R can carry on
+ * producing graphics while the disk is busy. This needs POSIX threads, which
+ * the Windows toolchain does not provide, so there output is always written
+ * by the R thread.
+ */
+#ifndef _WIN32
+#define TIKZ_ASYNC_WRITE 1
+#include <pthread.h>
+#endif
+
 /* Macro definitions */
 #define TIKZ_NAMESPACE R_FindNamespace(mkString("tikzDevice"))
 
+/*
+ * Coordinates are written as fixed point numbers with at most this many digits
+ * after the decimal point. Four digits resolve lengths far smaller than
+ * anything TeX or a PDF viewer will render and keep the scaled integer values
+ * used by the formatting routines comfortably inside 64 bits.
+ */
+#define TIKZ_MAX_PRECISION 4
+/* Enough room for a sign, 16 integer digits, a point and the fraction. */
+#define TIKZ_NUMBER_LENGTH 24
+/* Number of vertices that are scaled and rounded as a group. */
+#define TIKZ_VERTEX_BLOCK 256
+/*
+ * When writing relative coordinates, start a new line of output after this
+ * many vertices. TeX reads its input a line at a time into a buffer of limited
+ * size, so a path can not be written as one enormous line.
+ */
+#define TIKZ_VERTICES_PER_LINE 16
+
+/*
+ * Largest number of vertices a polygon or line may have to be considered for
+ * reuse as a plot mark. Plot symbols have only a handful of vertices.
+ */
+#define TIKZ_MAX_MARK_VERTICES 32
+
+/* Room for the name of a palette color such as `tikzdevColor12`. */
+#define TIKZ_COLOR_NAME_LENGTH 32
+
+/*
+ * Largest number of values passed to Lua by a single \directlua call in the
+ * LuaTeX drawing mode. TeX reads the whole argument of the call before Lua
+ * sees any of it, so the coordinates of a large shape are split up.
+ */
+#define TIKZ_LUA_CHUNK 8192
+
+/*
+ * Room for the page number and the suffix, such as `_data12.dat` or
+ * `_frag3.tex`, added to the name of the output file to name a data or
+ * fragment file.
+ */
+#define TIKZ_DATA_SUFFIX_LENGTH 48
+
+/*
+ * Largest amount of output a clipping scope may produce and still be
+ * remembered for reuse. Larger scopes are written out as they are drawn.
+ */
+#define TIKZ_MAX_GROUP_LENGTH 1048576
+
 
 /*
  * tikz_engine can take on possible values from a list of all the TeX engines
@@ -52,6 +110,229 @@ typedef enum {
 } TikZ_ClipState;
 
 
+/*
+ * Kinds of shape that may be collected into a single \path by
+ * `TikZ_ContinueBatch`.
+ */
+typedef enum {
+  TIKZ_BATCH_NONE = 0,
+  TIKZ_BATCH_CIRCLE = 1,
+  TIKZ_BATCH_LINE = 2,
+  TIKZ_BATCH_RECTANGLE = 3,
+  TIKZ_BATCH_MARK = 4
+} TikZ_BatchKind;
+
+/* The forms in which `printVertices` can write a coordinate pair. */
+typedef enum {
+  TIKZ_POINT_TIKZ = 0,
+  TIKZ_POINT_PGF = 1,
+  TIKZ_POINT_LUA = 2
+} TikZ_PointFormat;
+
+
+/*
+ * How the vertices of a shape lie with respect to the region in which it can
+ * be seen, as determined by `TikZ_Overlap`.
+ */
+typedef enum {
+  TIKZ_OUTSIDE = 0,
+  TIKZ_CROSSING = 1,
+  TIKZ_INSIDE = 2
+} TikZ_OverlapKind;
+
+
+/*
+ * Largest number of cells along either side of the grid used to find shapes
+ * that are hidden by later ones, and the size of a cell in points when the
+ * page is small enough.
+ */
+#define TIKZ_COVERAGE_CELLS 4096
+#define TIKZ_COVERAGE_CELL_SIZE 0.25
+
+typedef enum {
+  TIKZ_OCCLUDER_NONE = 0,
+  TIKZ_OCCLUDER_CIRCLE = 1,
+  TIKZ_OCCLUDER_POLYGON = 2
+} TikZ_OccluderKind;
+
+/*
+ * TikZ_Shape records an opaque shape written to the current page so that it
+ * can be removed from the output again if later shapes cover it completely.
+ * `start` and `end` delimit the text of the shape in the output buffer and
+ * `pathStart` the \path it belongs to. The bounding box includes the stroke
+ * and for circles `r` is the radius of everything they paint. Shapes with an
+ * opaque fill also keep the area they hide, given by the radius `inner` for
+ * circles and for polygons as a range of the vertices stored in
+ * `shapeVertices`.
+ */
+typedef struct {
+  size_t pathStart, start, end;
+  double left, bottom, right, top;
+  double clipLeft, clipBottom, clipRight, clipTop;
+  Rboolean circle;
+  double x, y, r;
+  TikZ_OccluderKind occluder;
+  double inner;
+  int vertexOffset, vertexCount;
+  Rboolean hidden;
+} TikZ_Shape;
+
+
+/*
+ * Largest number of pixels a canvas for rasterized primitives may have. The
+ * resolution is lowered for clipping regions that would need more.
+ */
+#define TIKZ_MAX_CANVAS_PIXELS 16777216
+
+/*
+ * TikZ_Canvas is the image that primitives are painted on once a clipping
+ * region holds more of them than the raster budget allows. It covers the
+ * clipping region, `scale` pixels to the point, and holds premultiplied RGBA
+ * values with the top row first. `pixels` is NULL while nothing is painted.
+ * `coverage` is scratch space in which a stroke is collected before it is
+ * blended onto the pixels.
+ */
+typedef struct {
+  unsigned char *pixels;
+  int columns, rows;
+  double left, top, scale;
+  float *coverage;
+  size_t coverageCapacity;
+} TikZ_Canvas;
+
+/*
+ * Fewest cells a grid of rectangles must have to be written as a raster, and
+ * how far, as a fraction of a cell, a rectangle may be off the grid and still
+ * be counted as one of its cells.
+ */
+#define TIKZ_MIN_TILES 64
+#define TIKZ_TILE_TOLERANCE 0.001
+
+/*
+ * TikZ_Tile is a filled rectangle held back because it may be a cell of an
+ * image or heatmap. The corners are kept as given so that the rectangle can
+ * still be written normally, `column` and `row` give its place in the grid.
+ */
+typedef struct {
+  double x0, y0, x1, y1;
+  int column, row;
+  int fill;
+} TikZ_Tile;
+
+/*
+ * Most primitives held back at a time so that they can be written in a better
+ * order, and the most columns and rows of the grid used to find out which of
+ * them overlap.
+ */
+#define TIKZ_MAX_HELD 16384
+#define TIKZ_HELD_GRID 64
+
+typedef enum {
+  TIKZ_HELD_CIRCLE,
+  TIKZ_HELD_RECTANGLE,
+  TIKZ_HELD_LINE,
+  TIKZ_HELD_POLYLINE,
+  TIKZ_HELD_POLYGON
+} TikZ_HeldKind;
+
+/*
+ * TikZ_Held is a primitive held back by `TikZ_HoldPrimitive`. Its `n` vertices
+ * are kept in `heldValues` starting at `values`, all x coordinates followed by
+ * all y coordinates, and `r` is the radius of a circle. The bounding box
+ * includes the reach of the stroke. Only the drawing parameters that shapes
+ * make use of are kept, among them the font size that `TikZ_SymbolSized`
+ * compares shapes with. `layer` and `style` are worked out by
+ * `TikZ_FlushHeld`, `index` is the position in the order of drawing.
+ */
+typedef struct {
+  TikZ_HeldKind kind;
+  int n;
+  size_t values;
+  double r;
+  double left, bottom, right, top;
+  int col, fill, lty;
+  double lwd, lmitre;
+  R_GE_lineend lend;
+  R_GE_linejoin ljoin;
+  double cex, ps, gamma;
+  int index, layer, style;
+} TikZ_Held;
+
+/* An edge of a polygon crossing the scanline being filled on a canvas. */
+typedef struct {
+  double x;
+  int winding;
+} TikZ_Crossing;
+
+
+/*
+ * TikZ_Buffer is a growable block of characters. The device uses one to
+ * collect output so that it can be written in large chunks instead of one
+ * tiny fragment at a time. The data is always kept NUL terminated so that the
+ * contents can be handed to routines that expect a C string.
+ */
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+} TikZ_Buffer;
+
+
+/*
+ * TikZ_Dictionary is a hash table that maps keys, which are arbitrary blocks
+ * of bytes, to integer values. The device uses dictionaries to remember things
+ * it has already written, such as sets of path options, so that they can be
+ * referred to by name instead of being written out again.
+ */
+typedef struct {
+  char *key;
+  size_t keyLength;
+  unsigned int hash;
+  int value;
+} TikZ_DictionaryEntry;
+
+typedef struct {
+  TikZ_DictionaryEntry *entries;
+  size_t count;
+  size_t capacity;
+} TikZ_Dictionary;
+
+
+/*
+ * TikZ_Options collects the settings that tune the output of the device,
+ * most of which come from the global tikz* options. `TikZ_StartDevice` fills
+ * it in from its arguments, in the order they are passed by `tikz`, and hands
+ * it to `TikZ_Setup` as a whole.
+ */
+typedef struct {
+  int outputBufferSize;
+  int coordPrecision;
+  Rboolean trimZeros;
+  Rboolean relativeCoords;
+  Rboolean styleDictionary;
+  double simplifyTolerance;
+  Rboolean dropRedundant;
+  Rboolean batchPrimitives;
+  Rboolean plotMarks;
+  SEXP memory;
+  Rboolean asyncWrite;
+  Rboolean clipPrimitives;
+  Rboolean occlusionCulling;
+  Rboolean colorPalette;
+  int rasterBudget;
+  double rasterResolution;
+  double decimationWidth;
+  Rboolean rasterizeTiles;
+  Rboolean pgfBasicLayer;
+  int dataThreshold;
+  Rboolean luaDrawing;
+  const char *luaCode;
+  int fragmentSize, fragmentPrimitives;
+  Rboolean reuseGroups;
+  Rboolean reorderPrimitives;
+} TikZ_Options;
+
+
 /*
  * tikzDevDesc is a structure that is used to hold information
  * that is unique to the implementation of the TikZ Device. A
@@ -80,6 +361,99 @@ typedef struct {
 	Rboolean sanitize;
   TikZ_ClipState clipState;
   TikZ_PageState pageState;
+  TikZ_Buffer output;
+  size_t outputBufferSize;
+  int coordPrecision;
+  double coordScale;
+  Rboolean trimZeros;
+  Rboolean relativeCoords;
+  TikZ_Buffer style;
+  Rboolean styleDictionary;
+  TikZ_Dictionary styles;
+  int styleCount;
+  double simplifyTolerance;
+  Rboolean dropRedundant;
+  double decimationWidth;
+  double *vertexX, *vertexY;
+  int *vertexStack;
+  unsigned char *vertexKeep;
+  int vertexCapacity;
+  Rboolean batchPrimitives;
+  TikZ_BatchKind batchKind;
+  TikZ_Buffer batchStyle;
+  double batchLeft, batchBottom, batchRight, batchTop;
+  double batchEndX, batchEndY;
+  int batchMark;
+  Rboolean plotMarks;
+  TikZ_Dictionary marks;
+  int markCount;
+  double clipX0, clipY0, clipX1, clipY1;
+  Rboolean clipPrimitives;
+  double *clippedX, *clippedY, *clippedSwapX, *clippedSwapY;
+  int *clippedRuns;
+  int clippedCapacity;
+  Rboolean occlusionCulling;
+  TikZ_Shape *shapes;
+  int shapeCount, shapeCapacity, currentShape;
+  double *shapeVertices;
+  int shapeVertexCount, shapeVertexCapacity;
+  size_t pathStart;
+  Rboolean colorPalette;
+  TikZ_Dictionary palette;
+  int colorCount;
+  char drawColorName[TIKZ_COLOR_NAME_LENGTH];
+  char fillColorName[TIKZ_COLOR_NAME_LENGTH];
+  int rasterBudget;
+  double rasterResolution;
+  int regionPrimitives;
+  TikZ_Canvas canvas;
+  TikZ_Crossing *crossings;
+  int crossingCapacity;
+  Rboolean rasterizeTiles;
+  TikZ_Tile *tiles;
+  int tileCount, tileCapacity;
+  double tileLeft, tileBottom, tileWidth, tileHeight;
+  R_GE_gcontext tileParams;
+  TikZ_Dictionary tileCells;
+  Rboolean pgfBasicLayer;
+  int styleOps, pathOps;
+  int dataThreshold;
+  int dataFileCount;
+  char *dataFileName;
+  TikZ_Buffer data;
+  Rboolean luaDrawing;
+  char *luaCode;
+  Rboolean luaPath;
+  int luaValues;
+  char luaPaint[32];
+  int fragmentSize, fragmentPrimitives;
+  int fragmentFileCount, fragmentDrawn;
+  size_t fragmentWritten;
+  char *fragmentFileName;
+  FILE *mainFile;
+  Rboolean reuseGroups;
+  TikZ_Dictionary groups;
+  int groupCount;
+  size_t groupStart;
+  double originX, originY;
+  Rboolean reorderPrimitives;
+  Rboolean heldReplay;
+  TikZ_Held *held;
+  int heldCount, heldCapacity;
+  double *heldValues;
+  size_t heldValueCount, heldValueCapacity;
+  R_GE_gcontext heldParams;
+  SEXP memory;
+  Rboolean asyncWrite;
+#ifdef TIKZ_ASYNC_WRITE
+  pthread_t writer;
+  pthread_mutex_t writerLock;
+  pthread_cond_t writerSignal;
+  TikZ_Buffer pending;
+  Rboolean writerRunning;
+  Rboolean writerStop;
+  Rboolean writerError;
+#endif
 } tikzDevDesc;
 
 
@@ -99,7 +473,8 @@ static Rboolean TikZ_Setup(
 		Rboolean standAlone, Rboolean bareBones,
 		const char *documentDeclaration,
 		const char *packages, const char *footer,
-		Rboolean console, Rboolean sanitize, int engine );
+		Rboolean console, Rboolean sanitize, int engine,
+		TikZ_Options options );
 
 
 /* Graphics Engine function hooks. Defined in GraphicsDevice.h . */
@@ -126,6 +501,8 @@ static void TikZ_Circle( double x, double y, double r,
 		const pGEcontext plotParams, pDevDesc deviceInfo );
 static void TikZ_Rectangle( double x0, double y0, 
 		double x1, double y1, const pGEcontext plotParams, pDevDesc deviceInfo );
+static void TikZ_WriteRectangle( double x0, double y0,
+		double x1, double y1, const pGEcontext plotParams, pDevDesc deviceInfo );
 static void TikZ_Line( double x1, double y1,
 		double x2, double y2, const pGEcontext plotParams, pDevDesc deviceInfo );
 static void TikZ_Polyline( int n, double *x, double *y,
@@ -176,17 +553,138 @@ typedef enum {
 static TikZ_DrawOps TikZ_GetDrawOps(pGEcontext plotParams);
 
 static void TikZ_DefineColors(const pGEcontext plotParams, pDevDesc deviceInfo, TikZ_DrawOps ops);
+static void TikZ_PaletteColor(tikzDevDesc *tikzInfo, int color, char *name);
 static void TikZ_WriteDrawOptions(const pGEcontext plotParams, pDevDesc deviceInfo, TikZ_DrawOps ops);
+static void TikZ_WritePgfOptions(const pGEcontext plotParams, tikzDevDesc *tikzInfo,
+    TikZ_DrawOps ops);
+static void TikZ_StartPath(tikzDevDesc *tikzInfo);
+static void TikZ_EndOptions(tikzDevDesc *tikzInfo, const char *separator);
+static void TikZ_EndPath(tikzDevDesc *tikzInfo);
+static void TikZ_StartLua(tikzDevDesc *tikzInfo, Rboolean circles, Rboolean closed,
+    Rboolean evenOdd);
+static void TikZ_LuaValues(tikzDevDesc *tikzInfo, int count);
+static Rboolean TikZ_ContinueBatch(const pGEcontext plotParams, tikzDevDesc *tikzInfo,
+    TikZ_DrawOps ops, TikZ_BatchKind kind, int mark,
+    double left, double bottom, double right, double top);
+static Rboolean TikZ_WriteMark(const pGEcontext plotParams, tikzDevDesc *tikzInfo,
+    TikZ_DrawOps ops, int n, double *x, double *y, Rboolean closed);
+static void TikZ_FinishShape(tikzDevDesc *tikzInfo);
+static void TikZ_EndBatch(tikzDevDesc *tikzInfo);
 static void TikZ_WriteLineStyle(pGEcontext plotParams, tikzDevDesc *tikzInfo);
+static double TikZ_StrokeReach(const pGEcontext plotParams, TikZ_DrawOps ops);
+static Rboolean TikZ_VisibleRegion(const pGEcontext plotParams, pDevDesc deviceInfo,
+    TikZ_DrawOps ops, double *region);
+static Rboolean TikZ_Culled(const pGEcontext plotParams, pDevDesc deviceInfo,
+    TikZ_DrawOps ops, double left, double bottom, double right, double top);
+static TikZ_OverlapKind TikZ_Overlap(const double *region, int n, double *x, double *y);
+static TikZ_Shape *TikZ_RecordShape(const pGEcontext plotParams, pDevDesc deviceInfo,
+    TikZ_DrawOps ops, double left, double bottom, double right, double top);
+static void TikZ_RecordPolygon(const pGEcontext plotParams, pDevDesc deviceInfo,
+    TikZ_DrawOps ops, int n, double *x, double *y);
+static void TikZ_SetPolygonOccluder(tikzDevDesc *tikzInfo, TikZ_Shape *shape,
+    int n, double *x, double *y);
+static void TikZ_ShapeStart(tikzDevDesc *tikzInfo);
+static void TikZ_ShapeEnd(tikzDevDesc *tikzInfo);
+static void TikZ_CullOccluded(pDevDesc deviceInfo);
+static Rboolean TikZ_ShapeKey(tikzDevDesc *tikzInfo, const TikZ_Shape *shape,
+    TikZ_Buffer *key);
+static void cutText(char *data, size_t *read, size_t *write, size_t from, size_t to);
+static void coverOccluder(unsigned char *mask, int columns, int rows, double cell,
+    const TikZ_Shape *shape, const double *vertices, double margin);
+static Rboolean shapeCovered(const unsigned char *mask, int columns, int rows,
+    double cell, const TikZ_Shape *shape);
+static Rboolean insideConvex(int n, const double *vertices, double px, double py);
+static Rboolean TikZ_Rasterize(pDevDesc deviceInfo, int primitives);
+static Rboolean TikZ_SymbolSized(const pGEcontext plotParams,
+	double left, double bottom, double right, double top);
+static void TikZ_FlushCanvas(pDevDesc deviceInfo);
+static void TikZ_PaintCircle(tikzDevDesc *tikzInfo, const pGEcontext plotParams,
+    TikZ_DrawOps ops, double x, double y, double r);
+static void TikZ_PaintShape(tikzDevDesc *tikzInfo, const pGEcontext plotParams,
+    TikZ_DrawOps ops, int npoly, const int *nper, const double *x, const double *y,
+    Rboolean closed, Rboolean winding);
+static void paintPixel(TikZ_Canvas *canvas, int column, int row, int color,
+    double coverage);
+static void paintFill(tikzDevDesc *tikzInfo, int npoly, const int *nper,
+    const double *x, const double *y, Rboolean winding, int color);
+static void paintStroke(TikZ_Canvas *canvas, int n, const double *x,
+    const double *y, Rboolean closed, double halfWidth, int color);
+static int canvasIndex(double position, int count);
+static Rboolean TikZ_CollectTile(double x0, double y0, double x1, double y1,
+    const pGEcontext plotParams, pDevDesc deviceInfo);
+static void TikZ_FlushTiles(pDevDesc deviceInfo);
+static Rboolean TikZ_HoldPrimitive(const pGEcontext plotParams,
+    pDevDesc deviceInfo, TikZ_HeldKind kind, int n, double *x, double *y,
+    double r);
+static void TikZ_FlushHeld(pDevDesc deviceInfo);
+static int compareHeld(const void *a, const void *b);
+static int compareCrossings(const void *a, const void *b);
 
 static double ScaleFont( const pGEcontext plotParams, pDevDesc deviceInfo );
 
 /* Utility Routines*/
 static void printOutput(tikzDevDesc *tikzInfo, const char *format, ...);
+static void printStyle(tikzDevDesc *tikzInfo, const char *format, ...);
+static void TikZ_BufferPrintf(TikZ_Buffer *buffer, const char *format, va_list ap);
+static void writeOutput(tikzDevDesc *tikzInfo, const char *str, size_t length);
+static void flushOutput(tikzDevDesc *tikzInfo);
+static void TikZ_WaitForWriter(tikzDevDesc *tikzInfo);
+static void TikZ_StopWriter(tikzDevDesc *tikzInfo);
+static void TikZ_CheckWriter(tikzDevDesc *tikzInfo);
+#ifdef TIKZ_ASYNC_WRITE
+static void TikZ_QueueOutput(tikzDevDesc *tikzInfo);
+static void *TikZ_WriterThread(void *data);
+#endif
+static void TikZ_BufferReserve(TikZ_Buffer *buffer, size_t extra);
+static TikZ_DictionaryEntry *TikZ_DictionaryInsert(TikZ_Dictionary *dict,
+    const char *key, size_t keyLength, Rboolean *created);
+static void TikZ_DictionaryClear(TikZ_Dictionary *dict);
+static int formatFixed(char *str, long long value, int decimals, Rboolean trim);
+static void printNumber(tikzDevDesc *tikzInfo, double value);
+static void printCoordinate(tikzDevDesc *tikzInfo, double x, double y);
+static void printPoint(tikzDevDesc *tikzInfo, double x, double y);
+static void printVertices(tikzDevDesc *tikzInfo, int n, double *x, double *y,
+    const char *separator, TikZ_PointFormat format);
+static void printRelativeVertices(tikzDevDesc *tikzInfo, int n, double *x, double *y);
+static void printPolyline(tikzDevDesc *tikzInfo, int n, double *x, double *y);
+static Rboolean TikZ_WriteDataFile(tikzDevDesc *tikzInfo, int n, double *x, double *y);
+static const char *TikZ_BaseName(const char *path);
+static void TikZ_SiblingFileName(tikzDevDesc *tikzInfo, char *name,
+    const char *suffix, int count);
+static void printCycle(tikzDevDesc *tikzInfo);
+static void printCircle(tikzDevDesc *tikzInfo, double x, double y, double r);
+static void printRectangle(tikzDevDesc *tikzInfo, double x0, double y0,
+    double x1, double y1);
+static void printSegment(tikzDevDesc *tikzInfo, double x1, double y1,
+    double x2, double y2, Rboolean joined);
+static void printLuaSubpath(tikzDevDesc *tikzInfo, int n, double *x, double *y);
+static void printLuaCircle(tikzDevDesc *tikzInfo, double x, double y, double r);
+static int TikZ_PrepareVertices(tikzDevDesc *tikzInfo, int n, double *x, double *y,
+    Rboolean closed, double **outX, double **outY);
+static void TikZ_ReserveVertices(tikzDevDesc *tikzInfo, int n);
+static int simplifyVertices(tikzDevDesc *tikzInfo, int n, double *x, double *y,
+    Rboolean closed, double tolerance);
+static int dropRedundantVertices(tikzDevDesc *tikzInfo, int n, double *x, double *y,
+    Rboolean closed);
+static int decimateVertices(int n, double *x, double *y, double width);
+static Rboolean clipSegment(const double *region, double *x1, double *y1,
+    double *x2, double *y2);
+static int clipPolyline(tikzDevDesc *tikzInfo, const double *region, int n,
+    double *x, double *y);
+static double edgeDistance(const double *region, int edge, double x, double y);
+static int clipPolygon(tikzDevDesc *tikzInfo, const double *region, int n,
+    double *x, double *y);
+static void TikZ_ReserveClipped(tikzDevDesc *tikzInfo, int n);
+static void scaleVertices(tikzDevDesc *tikzInfo, int n, double *x, double *y,
+    double *scaledX, double *scaledY);
 static void Print_TikZ_Header( tikzDevDesc *tikzInfo );
 static char *Sanitize(const char *str);
 static Rboolean contains_multibyte_chars(const char *str);
 static double dim2dev( double length );
 static void TikZ_CheckState(pDevDesc deviceInfo);
+static void TikZ_CheckFragment(tikzDevDesc *tikzInfo);
+static void TikZ_EndFragment(tikzDevDesc *tikzInfo);
+static void TikZ_StartGroup(pDevDesc deviceInfo);
+static void TikZ_EndGroup(tikzDevDesc *tikzInfo);
 
 #endif // End of Once Only header